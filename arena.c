@@ -0,0 +1,75 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+#define ARENA_HUGE_PAGE ((size_t)2 << 20)
+
+/*
+Large arenas are placed on a 2 MiB boundary and flagged for transparent huge
+pages: the carving buffers are walked row by row over the whole image, and
+with 4 KiB pages a 1080p job alone spans several thousand TLB entries.
+
+False, with arena left empty, if the system has no memory to map.
+*/
+bool arena_try_new(size_t size, Arena *arena) {
+  *arena = (Arena){0};
+  size_t bytes = arena_bytes(size, 1);
+  bool huge = bytes >= ARENA_HUGE_PAGE;
+  size_t span = (bytes + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+  size_t map_size = huge ? span + ARENA_HUGE_PAGE : bytes;
+  void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  *arena = (Arena){
+      .base = map,
+      .size = bytes,
+      .map = map,
+      .map_size = map_size,
+  };
+  if (huge) {
+    uintptr_t at = (uintptr_t)map;
+    at = (at + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+    arena->base = (uint8_t *)at;
+    madvise(arena->base, span, MADV_HUGEPAGE);
+  }
+  return true;
+}
+
+// For the setup of the tools, which have nothing to fall back on
+Arena arena_new(size_t size) {
+  Arena arena;
+  bool mapped = arena_try_new(size, &arena);
+  assert(mapped);
+  (void)mapped;
+  return arena;
+}
+
+// An arena over memory the caller owns and frees, aligned up from wherever it
+// starts. Not to be destroyed.
+Arena arena_on(void *memory, size_t size) {
+  uintptr_t at = (uintptr_t)memory;
+  at = (at + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+  size_t skip = at - (uintptr_t)memory;
+  return (Arena){
+      .base = (uint8_t *)at,
+      .size = size > skip ? (size - skip) & ~(size_t)(ARENA_ALIGN - 1) : 0,
+  };
+}
+
+void arena_destroy(Arena *arena) {
+  munmap(arena->map, arena->map_size);
+  *arena = (Arena){0};
+}
+
+void *arena_alloc(Arena *arena, size_t nb, size_t size) {
+  size_t bytes = arena_bytes(nb, size);
+  assert(bytes <= arena->size - arena->used);
+  void *ptr = arena->base + arena->used;
+  arena->used += bytes;
+  return ptr;
+}
@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every allocation starts on its own cache line
+#define ARENA_ALIGN 64
+
+/*
+A bump allocator over a single block acquired once at setup. Allocations are
+never freed individually: callers take a mark after the long-lived buffers are
+in place and rewind to it to start a new job. Rewinding never touches the
+memory, so a reset costs nothing regardless of the image size.
+*/
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  void *map;
+  size_t map_size;
+} Arena;
+
+Arena arena_new(size_t size);
+bool arena_try_new(size_t size, Arena *arena);
+Arena arena_on(void *memory, size_t size);
+void arena_destroy(Arena *arena);
+
+void *arena_alloc(Arena *arena, size_t nb, size_t size);
+
+static inline size_t arena_mark(Arena *arena) { return arena->used; }
+
+static inline void arena_rewind(Arena *arena, size_t mark) {
+  arena->used = mark;
+}
+
+static inline void arena_reset(Arena *arena) { arena->used = 0; }
+
+// Rounds a byte count up to the arena alignment, so that callers can size an
+// arena from the list of buffers they are going to put in it.
+static inline size_t arena_bytes(size_t nb, size_t size) {
+  return (nb * size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+#endif // ARENA_H
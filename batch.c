@@ -0,0 +1,521 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "carve.h"
+#include "pyramid.h"
+#include "rawio.h"
+#include "resample.h"
+#include "strips.h"
+#include "trace.h"
+
+typedef struct {
+  char *path;
+  off_t bytes;
+  long pixels;
+  double seconds;
+  bool ok;
+} Job;
+
+/*
+A Chase-Lev deque of job indices. All the jobs are in place before the pool
+starts, so the owner only ever pops from the bottom and thieves take from the
+top; the two only race for the last job.
+*/
+typedef struct {
+  int *jobs;
+  atomic_long top;
+  atomic_long bottom;
+} Deque;
+
+#define DEQUE_EMPTY -1
+#define DEQUE_CONTENDED -2
+
+typedef struct Batch Batch;
+
+typedef struct {
+  pthread_t thread;
+  int id;
+  Batch *batch;
+  Deque deque;
+  // Rewound for every image and only replaced when one does not fit
+  Arena arena;
+  // Threads of the strips, NULL unless the images are carved in strips
+  StripPool *strips;
+} Runner;
+
+struct Batch {
+  const BatchOptions *options;
+  Job *jobs;
+  int count;
+  Runner *runners;
+  int threads;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int deque_pop(Deque *d) {
+  long b = atomic_load(&d->bottom) - 1;
+  atomic_store(&d->bottom, b);
+  long t = atomic_load(&d->top);
+  if (t > b) {
+    atomic_store(&d->bottom, b + 1);
+    return DEQUE_EMPTY;
+  }
+
+  int job = d->jobs[b];
+  if (t == b) {
+    if (!atomic_compare_exchange_strong(&d->top, &t, t + 1)) {
+      job = DEQUE_EMPTY;
+    }
+    atomic_store(&d->bottom, b + 1);
+  }
+  return job;
+}
+
+static int deque_steal(Deque *d) {
+  long t = atomic_load(&d->top);
+  long b = atomic_load(&d->bottom);
+  if (t >= b) {
+    return DEQUE_EMPTY;
+  }
+
+  int job = d->jobs[t];
+  if (!atomic_compare_exchange_strong(&d->top, &t, t + 1)) {
+    return DEQUE_CONTENDED;
+  }
+  return job;
+}
+
+// Own jobs first, then everyone else's, until every deque is seen empty
+static int runner_next(Runner *r) {
+  int job = deque_pop(&r->deque);
+  while (job < 0) {
+    bool contended = false;
+    for (int i = 1; i < r->batch->threads; i++) {
+      Runner *victim = &r->batch->runners[(r->id + i) % r->batch->threads];
+      job = deque_steal(&victim->deque);
+      if (job >= 0) {
+        return job;
+      }
+      contended |= job == DEQUE_CONTENDED;
+    }
+    if (!contended) {
+      return DEQUE_EMPTY;
+    }
+  }
+  return job;
+}
+
+// False, with no arena left, if the system has no memory for one this large
+static bool runner_reserve(Runner *r, size_t bytes) {
+  if (r->arena.size < bytes) {
+    if (r->arena.base != NULL) {
+      arena_destroy(&r->arena);
+    }
+    if (!arena_try_new(bytes + bytes / 4, &r->arena)) {
+      return false;
+    }
+  }
+  arena_reset(&r->arena);
+  return true;
+}
+
+static const char *output_path(const char *input, const char *dir,
+                               const char *ext, char *path, size_t size) {
+  const char *name = strrchr(input, '/');
+  name = name != NULL ? name + 1 : input;
+  const char *dot = strrchr(name, '.');
+  int stem = dot != NULL && dot != name ? (int)(dot - name) : (int)strlen(name);
+  snprintf(path, size, "%s/%.*s%s", dir, stem, name, ext);
+  return path;
+}
+
+static float mean_energy(Mat gradient) {
+  double sum = 0;
+  for (int y = 0; y < gradient.height; y++) {
+    const float *row = MAT_ROW(gradient, y);
+    for (int x = 0; x < gradient.width; x++) {
+      sum += row[x];
+    }
+  }
+  return sum / ((double)gradient.width * gradient.height);
+}
+
+static bool carve_job(Runner *r, Job *job) {
+  const BatchOptions *options = r->batch->options;
+  RawImage raw = {0};
+  Image img = {0};
+  bool mapped = raw_image_open(job->path, 0, 0, &raw);
+  if (mapped) {
+    img.width = raw.width;
+    img.height = raw.height;
+  } else {
+    img = LoadImage(job->path);
+    if (img.data == NULL) {
+      fprintf(stderr, "Could not load %s\n", job->path);
+      return false;
+    }
+    ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  }
+
+  int w = img.width;
+  int h = img.height;
+  int target = options->target_width > 0
+                   ? options->target_width
+                   : (int)(w * options->target_scale + 0.5f);
+  target = target < 1 ? 1 : target > w ? w : target;
+  job->pixels = (long)w * h;
+
+  // Seams take the width down to carve_to at most, scaling the rest
+  int carve_to = target;
+  if (options->hybrid > 0) {
+    int budget = (int)(w * options->hybrid);
+    carve_to = w - budget > target ? w - budget : target;
+  }
+
+  // Below a few blocks a side the coarse search has nothing to go on
+  int factor = options->pyramid;
+  int strips = options->strips;
+  bool coarse = strips <= 1 && factor > 1 &&
+                w >= PYRAMID_MIN_BLOCKS * factor &&
+                h >= PYRAMID_MIN_BLOCKS * factor;
+  size_t pixels = mapped && !raw.in_place ? (size_t)w * h : 0;
+  size_t bytes = arena_bytes(pixels, sizeof(Color)) + 3 * mat_bytes(w, h) +
+                 arena_bytes(h, sizeof(int)) +
+                 (coarse ? pyramid_bytes(w, h, factor) : 0) +
+                 (strips > 1 ? strips_bytes(w, h, strips) : 0) +
+                 (options->hybrid > 0 ? resampler_bytes(w, target) : 0);
+  // One image too large for the memory left is not worth the whole batch
+  if (!runner_reserve(r, bytes)) {
+    fprintf(stderr, "No memory to carve %s\n", job->path);
+    if (mapped) {
+      raw_image_close(&raw);
+    } else {
+      UnloadImage(img);
+    }
+    return false;
+  }
+  if (mapped) {
+    Color *buffer = raw.in_place ? NULL : arena_alloc(&r->arena, pixels,
+                                                      sizeof(Color));
+    img = raw_image_pixels(&raw, buffer);
+  }
+
+  Mat gradient = mat_alloc(&r->arena, w, h, 0.0f);
+  Mat dp = mat_alloc(&r->arena, w, h, FLT_MAX);
+  int *seam = arena_alloc(&r->arena, h, sizeof(int));
+  Pyramid pyramid = {0};
+  if (coarse) {
+    pyramid = pyramid_new(&r->arena, w, h, factor);
+  }
+  {
+    TRACE_SCOPE("sobel_filter");
+    Mat luminance = image_luminance(&r->arena, img, w);
+    sobel_filter(luminance, gradient);
+  }
+  float limit = options->hybrid > 0
+                    ? options->hybrid_cost * h * mean_energy(gradient)
+                    : FLT_MAX;
+
+  if (strips > 1) {
+    img = strips_carve(r->strips, &r->arena, img, w, &gradient, carve_to);
+  }
+  for (int s = img.width; s > carve_to; s--) {
+    if (coarse) {
+      pyramid_seam(&pyramid, gradient, dp, seam);
+    } else {
+      {
+        TRACE_SCOPE("gradient_to_dp");
+        gradient_to_dp(gradient, dp);
+      }
+      TRACE_SCOPE("compute_seam");
+      compute_seam(dp, seam);
+    }
+    if (seam_energy(gradient, seam) > limit) {
+      break;
+    }
+    TRACE_SCOPE("remove_seam");
+    for (int y = 0; y < h; y++) {
+      img_remove_column_at_row(img, y, seam[y], w);
+      mat_remove_column_at_row(gradient, y, seam[y]);
+    }
+    img.width--;
+    gradient.width--;
+    dp.width--;
+  }
+
+  if (img.width > target) {
+    TRACE_SCOPE("resample");
+    Resampler resampler = resampler_new(&r->arena, img.width, target);
+    for (int y = 0; y < h; y++) {
+      resample_row(&resampler, &((Color *)img.data)[y * w]);
+    }
+    img.width = target;
+  }
+
+  char path[PATH_MAX];
+  bool ok;
+  if (mapped) {
+    const char *ext = raw.format == RAW_PPM ? ".ppm" : ".pam";
+    output_path(job->path, options->output_dir, ext, path, sizeof(path));
+    ok = raw_image_write(path, img, w);
+    raw_image_close(&raw);
+  } else {
+    // Packs the rows for ExportImage, which knows nothing of strides
+    Color *data = img.data;
+    for (int y = 1; y < h; y++) {
+      memmove(&data[y * target], &data[y * w], target * sizeof(Color));
+    }
+    output_path(job->path, options->output_dir, ".png", path, sizeof(path));
+    ok = ExportImage(img, path);
+    UnloadImage(img);
+  }
+  if (!ok) {
+    fprintf(stderr, "Could not write %s\n", path);
+  }
+  return ok;
+}
+
+static void *runner_run(void *arg) {
+  Runner *r = arg;
+  trace_thread_name("runner");
+  int i;
+  while ((i = runner_next(r)) >= 0) {
+    Job *job = &r->batch->jobs[i];
+    double start = now();
+    TRACE_SCOPE("image");
+    job->ok = carve_job(r, job);
+    job->seconds = now() - start;
+  }
+  return NULL;
+}
+
+static bool add_job(Batch *b, int *capacity, const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return true;
+  }
+  if (b->count == *capacity) {
+    *capacity = *capacity > 0 ? *capacity * 2 : 256;
+    Job *jobs = realloc(b->jobs, *capacity * sizeof(Job));
+    if (jobs == NULL) {
+      return false;
+    }
+    b->jobs = jobs;
+  }
+  b->jobs[b->count++] = (Job){.path = strdup(path), .bytes = st.st_size};
+  return true;
+}
+
+// A directory holds the images, anything else is a manifest listing them
+static bool list_jobs(Batch *b, const char *input) {
+  int capacity = 0;
+  char path[PATH_MAX];
+  struct stat st;
+  if (stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(input);
+    if (dir == NULL) {
+      return false;
+    }
+    struct dirent *entry;
+    bool ok = true;
+    while (ok && (entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.') {
+        snprintf(path, sizeof(path), "%s/%s", input, entry->d_name);
+        ok = add_job(b, &capacity, path);
+      }
+    }
+    closedir(dir);
+    return ok;
+  }
+
+  FILE *manifest = fopen(input, "r");
+  if (manifest == NULL) {
+    return false;
+  }
+  bool ok = true;
+  while (ok && fgets(path, sizeof(path), manifest) != NULL) {
+    path[strcspn(path, "\r\n")] = '\0';
+    if (path[0] != '\0' && path[0] != '#') {
+      ok = add_job(b, &capacity, path);
+    }
+  }
+  fclose(manifest);
+  return ok;
+}
+
+static int by_bytes(const void *a, const void *b) {
+  off_t x = ((const Job *)a)->bytes;
+  off_t y = ((const Job *)b)->bytes;
+  return (x > y) - (x < y);
+}
+
+static int by_seconds(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static const struct {
+  const char *name;
+  long max_pixels;
+} size_classes[] = {
+    {"< 0.25 MP", 250000},
+    {"0.25-1 MP", 1000000},
+    {"1-4 MP", 4000000},
+    {">= 4 MP", LONG_MAX},
+};
+
+#define SIZE_CLASSES (int)(sizeof(size_classes) / sizeof(size_classes[0]))
+
+static double percentile(const double *sorted, int n, double p) {
+  int i = (int)(p * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+static void report(const Batch *b, int threads, double elapsed) {
+  int done = 0;
+  double pixels = 0;
+  for (int i = 0; i < b->count; i++) {
+    done += b->jobs[i].ok;
+    pixels += b->jobs[i].ok ? b->jobs[i].pixels : 0;
+  }
+  printf("Carved %d of %d images in %.2f s on %d threads: %.1f images/s, "
+         "%.1f MP/s\n",
+         done, b->count, elapsed, threads, done / elapsed,
+         pixels / 1e6 / elapsed);
+  printf("%-10s %7s %10s %9s %9s %9s %9s\n", "class", "images", "MP/s/thr",
+         "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+  double *seconds = malloc(b->count * sizeof(double));
+  long min_pixels = 0;
+  for (int c = 0; c < SIZE_CLASSES; c++) {
+    int n = 0;
+    double busy = 0;
+    double class_pixels = 0;
+    for (int i = 0; i < b->count; i++) {
+      const Job *job = &b->jobs[i];
+      if (job->ok && job->pixels >= min_pixels &&
+          job->pixels < size_classes[c].max_pixels) {
+        seconds[n++] = job->seconds;
+        busy += job->seconds;
+        class_pixels += job->pixels;
+      }
+    }
+    min_pixels = size_classes[c].max_pixels;
+    if (n == 0) {
+      continue;
+    }
+
+    qsort(seconds, n, sizeof(double), by_seconds);
+    printf("%-10s %7d %10.1f %9.1f %9.1f %9.1f %9.1f\n", size_classes[c].name,
+           n, class_pixels / 1e6 / busy, 1e3 * percentile(seconds, n, 0.5),
+           1e3 * percentile(seconds, n, 0.9),
+           1e3 * percentile(seconds, n, 0.99), 1e3 * seconds[n - 1]);
+  }
+  free(seconds);
+}
+
+/*
+Jobs are sorted by file size and dealt out in turn, so every deque holds its
+share in ascending order: the owner pops from the large end while thieves
+pick off the small ones. The deques of runners whose thread did not start are
+emptied by the others, and by the calling thread if none did.
+*/
+static void batch_run(Batch *b, int *slots) {
+  const BatchOptions *options = b->options;
+  qsort(b->jobs, b->count, sizeof(Job), by_bytes);
+  int used = 0;
+  for (int t = 0; t < b->threads; t++) {
+    Runner *r = &b->runners[t];
+    r->id = t;
+    r->batch = b;
+    r->deque.jobs = &slots[used];
+    int n = 0;
+    for (int i = t; i < b->count; i += b->threads) {
+      r->deque.jobs[n++] = i;
+    }
+    atomic_init(&r->deque.top, 0);
+    atomic_init(&r->deque.bottom, n);
+    used += n;
+    r->strips = options->strips > 1 ? strip_pool_new(options->strips) : NULL;
+  }
+
+  double start = now();
+  int started = 0;
+  for (; started < b->threads; started++) {
+    Runner *r = &b->runners[started];
+    if (pthread_create(&r->thread, NULL, runner_run, r) != 0) {
+      fprintf(stderr, "Could only start %d of %d threads\n", started,
+              b->threads);
+      break;
+    }
+  }
+  if (started == 0) {
+    runner_run(&b->runners[0]);
+  }
+  for (int t = 0; t < b->threads; t++) {
+    if (t < started) {
+      pthread_join(b->runners[t].thread, NULL);
+    }
+    if (b->runners[t].arena.base != NULL) {
+      arena_destroy(&b->runners[t].arena);
+    }
+    strip_pool_destroy(b->runners[t].strips);
+  }
+  report(b, started > 0 ? started : 1, now() - start);
+}
+
+bool batch_carve(const BatchOptions *options) {
+  Batch b = {.options = options};
+  if (!list_jobs(&b, options->input)) {
+    fprintf(stderr, "Could not read %s\n", options->input);
+    return false;
+  }
+  if (b.count == 0) {
+    fprintf(stderr, "No images in %s\n", options->input);
+    return false;
+  }
+  if (mkdir(options->output_dir, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create %s\n", options->output_dir);
+    return false;
+  }
+
+  b.threads = options->threads > 0 ? options->threads
+                                   : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  b.threads = b.threads < b.count ? b.threads : b.count;
+  b.runners = calloc(b.threads, sizeof(Runner));
+  int *slots = malloc(b.count * sizeof(int));
+  if (b.runners != NULL && slots != NULL) {
+    batch_run(&b, slots);
+  } else {
+    fprintf(stderr, "Out of memory for %d images\n", b.count);
+  }
+
+  bool ok = true;
+  for (int i = 0; i < b.count; i++) {
+    ok &= b.jobs[i].ok;
+    free(b.jobs[i].path);
+  }
+  free(b.jobs);
+  free(b.runners);
+  free(slots);
+  return ok;
+}
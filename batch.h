@@ -0,0 +1,42 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+
+/*
+Carves every image in a directory, or listed one path per line in a
+manifest, without opening a window. Images are spread over a pool of threads
+that steal from each other once their own queue runs dry, and each thread
+reuses one arena for all the images it carves. Throughput and latency
+percentiles are reported per image size class.
+
+Each image is carved to target_width, or to target_scale times its width
+when no width is given, and written to output_dir under the same name. PAM
+and PPM inputs are written back in their own format, anything else as PNG.
+With a pyramid factor, seams are searched coarse to fine in images large
+enough for it. With strips, every image wide enough is cut into that many
+strips carved side by side on threads of their own, on top of the pool.
+
+With a hybrid budget, seams only take up to that fraction of the width, and
+stop early at the first seam whose energy per row is past hybrid_cost times
+the mean energy of a pixel, where seams start to cut through detail; strips
+carve the whole budget. The rest of the way the rows are scaled down, in
+place.
+*/
+#define BATCH_HYBRID_COST 0.5f
+
+typedef struct {
+  const char *input;
+  const char *output_dir;
+  int threads;
+  int target_width;
+  float target_scale;
+  int pyramid;
+  int strips;
+  float hybrid;
+  float hybrid_cost;
+} BatchOptions;
+
+bool batch_carve(const BatchOptions *options);
+
+#endif // BATCH_H
@@ -0,0 +1,415 @@
+/*
+seam-bench: times each stage of the engine on its own, and whole carves
+through libseam, over a set of images. Results go out as JSON.
+
+  seam-bench [-n reps] [-s seams] [-b beam] [-o out.json] [image...]
+  seam-bench -c [-s seams] [-r randoms] [-S seed] [image...]
+
+Without images it runs over the PNGs in images/. Every repetition starts
+from the original image: luminance and Sobel run once, then DP, backtrack and
+removal once per seam. A first repetition warms the caches and is not
+recorded.
+
+With SEAM_PERF set, hardware counters are read around every stage as well.
+IPC and miss rates go into the JSON, along with counts per run of the stage,
+which is per seam for DP, backtrack and removal, and a summary goes to
+stderr.
+
+With -b, beam_seam of that width is timed as well, on the same gradient as
+every exact seam, and the JSON gets its speedup over DP and backtrack
+together and how much costlier its seams are, on average and at worst.
+
+With -c nothing is timed: the engine is checked against the plain reference
+kernels in bench/reference.c, stage by stage and over whole carves, on the
+images and on random ones (20 of them, 20 seams, unless told otherwise).
+Exits non zero if any check fails.
+*/
+#include <float.h>
+#include <glob.h>
+#include <raylib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "carve.h"
+#include "check.h"
+#include "libseam.h"
+#include "perf.h"
+#include "trace.h"
+
+typedef enum {
+  STAGE_LUMINANCE,
+  STAGE_SOBEL,
+  STAGE_DP,
+  STAGE_BACKTRACK,
+  STAGE_REMOVAL,
+  STAGE_BEAM,
+  STAGE_END_TO_END,
+  STAGES,
+} Stage;
+
+static const char *stage_names[STAGES] = {
+    "luminance", "sobel", "dp", "backtrack", "removal", "beam", "end_to_end",
+};
+
+// Times of every run of a stage, with the pixels and seams they covered
+typedef struct {
+  double *seconds;
+  int count;
+  double total;
+  double pixels;
+  double seams;
+  PerfTotals perf;
+} Samples;
+
+typedef struct {
+  int reps;
+  int seams;
+  int beam;
+} BenchOptions;
+
+// Cost of the beam seams over that of the exact ones, less one
+typedef struct {
+  double sum;
+  double max;
+  int count;
+} BeamGap;
+
+// Opened on the only thread that carves
+static PerfGroup counters;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Counters are read outside of the timed span
+static double stage_begin() {
+  perf_begin(&counters);
+  return now();
+}
+
+static void record(Samples *s, bool keep, double start, double pixels,
+                   double seams) {
+  double elapsed = now() - start;
+  if (keep) {
+    perf_end(&counters, &s->perf);
+    s->seconds[s->count++] = elapsed;
+    s->total += elapsed;
+    s->pixels += pixels;
+    s->seams += seams;
+  }
+}
+
+static int by_seconds(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+  int i = (int)(p * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+static double seam_cost(Mat gradient, const int *seam) {
+  double cost = 0;
+  for (int y = 0; y < gradient.height; y++) {
+    cost += MAT_AT(gradient, y, seam[y], gradient.stride);
+  }
+  return cost;
+}
+
+static void bench_image(Image src, const BenchOptions *options,
+                        Samples *samples, BeamGap *gap) {
+  int w = src.width;
+  int h = src.height;
+  int stride = img_stride_for(w);
+  int seams = options->seams;
+  int beam = options->beam;
+  Arena arena = arena_new(arena_bytes((size_t)stride * h, sizeof(Color)) +
+                          3 * mat_bytes(w, h) +
+                          2 * arena_bytes(h, sizeof(int)) +
+                          (beam > 0 ? beam_bytes(w, h, beam) : 0));
+  SeamCtx *ctx = seam_ctx_create(NULL);
+
+  for (int rep = -1; rep < options->reps; rep++) {
+    bool keep = rep >= 0;
+    arena_reset(&arena);
+    Image img = img_new(&arena, w, h, stride);
+    img_copy(img, stride, src, w);
+
+    double t = stage_begin();
+    Mat luminance = image_luminance(&arena, img, stride);
+    record(&samples[STAGE_LUMINANCE], keep, t, (double)w * h, 0);
+
+    Mat gradient = mat_alloc(&arena, w, h, 0.0f);
+    t = stage_begin();
+    sobel_filter(luminance, gradient);
+    record(&samples[STAGE_SOBEL], keep, t, (double)w * h, 0);
+
+    Mat dp = mat_alloc(&arena, w, h, FLT_MAX);
+    int *seam = arena_alloc(&arena, h, sizeof(int));
+    int *beam_path = arena_alloc(&arena, h, sizeof(int));
+    Beam search = {0};
+    if (beam > 0) {
+      search = beam_new(&arena, w, h, beam);
+    }
+    for (int s = 0; s < seams; s++) {
+      double pixels = (double)img.width * h;
+      t = stage_begin();
+      gradient_to_dp(gradient, dp);
+      record(&samples[STAGE_DP], keep, t, pixels, 1);
+
+      t = stage_begin();
+      compute_seam(dp, seam);
+      record(&samples[STAGE_BACKTRACK], keep, t, pixels, 1);
+
+      if (beam > 0) {
+        t = stage_begin();
+        beam_seam(&search, gradient, beam_path);
+        record(&samples[STAGE_BEAM], keep, t, pixels, 1);
+        if (keep) {
+          double best = seam_cost(gradient, seam);
+          double excess = (seam_cost(gradient, beam_path) - best) /
+                          (best > 1 ? best : 1);
+          gap->sum += excess;
+          gap->max = excess > gap->max ? excess : gap->max;
+          gap->count++;
+        }
+      }
+
+      t = stage_begin();
+      for (int y = 0; y < h; y++) {
+        img_remove_column_at_row(img, y, seam[y], stride);
+        mat_remove_column_at_row(gradient, y, seam[y]);
+      }
+      img.width--;
+      gradient.width--;
+      dp.width--;
+      record(&samples[STAGE_REMOVAL], keep, t, pixels, 1);
+    }
+
+    img = img_copy(img, stride, src, w);
+    SeamImage image = {img.data, w, h, stride};
+    t = stage_begin();
+    seam_ctx_carve(ctx, &image, w - seams, 0);
+    record(&samples[STAGE_END_TO_END], keep, t, (double)w * h, seams);
+  }
+
+  seam_ctx_destroy(ctx);
+  arena_destroy(&arena);
+}
+
+static const char *counter_names[PERF_COUNTERS] = {
+    "cycles",     "instructions", "llc_references",
+    "llc_misses", "branches",     "branch_misses",
+};
+
+static void write_ratio(FILE *out, const char *name, double ratio,
+                        double scale) {
+  if (ratio >= 0) {
+    fprintf(out, ", \"%s\": %.3f", name, scale * ratio);
+  }
+}
+
+static void write_counters(FILE *out, const PerfTotals *perf) {
+  fprintf(out, ", \"counters\": {\"runs\": %ld", perf->runs);
+  write_ratio(out, "ipc", perf_ratio(perf, PERF_INSTRUCTIONS, PERF_CYCLES),
+              1);
+  write_ratio(out, "llc_miss_pct",
+              perf_ratio(perf, PERF_LLC_MISSES, PERF_LLC_REFERENCES), 100);
+  write_ratio(out, "branch_miss_pct",
+              perf_ratio(perf, PERF_BRANCH_MISSES, PERF_BRANCHES), 100);
+  for (int c = 0; c < PERF_COUNTERS; c++) {
+    if (perf->counted[c]) {
+      fprintf(out, ", \"%s_per_run\": %.0f", counter_names[c],
+              perf->counts[c] / perf->runs);
+    }
+  }
+  fprintf(out, "}");
+}
+
+static void write_stage(FILE *out, Stage stage, Samples *s, bool last) {
+  qsort(s->seconds, s->count, sizeof(double), by_seconds);
+  fprintf(out,
+          "        \"%s\": {\"runs\": %d, \"median_ms\": %.4f, "
+          "\"p99_ms\": %.4f, \"mpixels_per_s\": %.2f",
+          stage_names[stage], s->count,
+          1e3 * percentile(s->seconds, s->count, 0.5),
+          1e3 * percentile(s->seconds, s->count, 0.99),
+          s->pixels / 1e6 / s->total);
+  if (s->seams > 0) {
+    fprintf(out, ", \"seams_per_s\": %.1f", s->seams / s->total);
+  }
+  if (s->perf.runs > 0) {
+    write_counters(out, &s->perf);
+  }
+  fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+// After write_stage, which sorts the samples
+static void write_beam(FILE *out, int beam, const Samples *samples,
+                       const BeamGap *gap) {
+  const Samples *dp = &samples[STAGE_DP];
+  const Samples *backtrack = &samples[STAGE_BACKTRACK];
+  const Samples *search = &samples[STAGE_BEAM];
+  double exact = percentile(dp->seconds, dp->count, 0.5) +
+                 percentile(backtrack->seconds, backtrack->count, 0.5);
+  double speedup = exact / percentile(search->seconds, search->count, 0.5);
+  fprintf(out,
+          ",\n      \"beam\": {\"width\": %d, \"speedup\": %.2f, "
+          "\"mean_gap_pct\": %.3f, \"max_gap_pct\": %.3f}",
+          beam, speedup, 100 * gap->sum / gap->count, 100 * gap->max);
+  fprintf(stderr, "  beam %d: %.2fx faster, seams %.2f%% costlier\n", beam,
+          speedup, 100 * gap->sum / gap->count);
+}
+
+static const char *base_name(const char *path) {
+  const char *name = strrchr(path, '/');
+  return name != NULL ? name + 1 : path;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-n reps] [-s seams] [-b beam] [-o out.json] "
+          "[image...]\n"
+          "       %s -c [-s seams] [-r randoms] [-S seed] [image...]\n",
+          program, program);
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options = {.reps = 5, .seams = 100};
+  CheckOptions check = {.seams = -1, .randoms = 20, .seed = 1};
+  bool checking = false;
+  const char *output = NULL;
+  trace_init();
+  perf_init();
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:b:o:cr:S:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      options.reps = atoi(optarg);
+      break;
+    case 's':
+      options.seams = check.seams = atoi(optarg);
+      break;
+    case 'b':
+      options.beam = atoi(optarg);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'c':
+      checking = true;
+      break;
+    case 'r':
+      check.randoms = atoi(optarg);
+      break;
+    case 'S':
+      check.seed = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (options.reps < 1 || options.seams < 0 || options.beam < 0 ||
+      check.randoms < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  glob_t found = {0};
+  char **paths = &argv[optind];
+  int count = argc - optind;
+  if (count == 0 && glob("images/*.png", 0, NULL, &found) == 0) {
+    paths = found.gl_pathv;
+    count = found.gl_pathc;
+  } else if (count == 0 && !checking) {
+    fprintf(stderr, "No images given and none in images/\n");
+    return 1;
+  }
+
+  SetTraceLogLevel(LOG_WARNING);
+  if (checking) {
+    check.paths = paths;
+    check.count = count;
+    check.seams = check.seams < 0 ? 20 : check.seams;
+    return check_run(&check) ? 0 : 1;
+  }
+
+  FILE *out = output != NULL ? fopen(output, "w") : stdout;
+  if (out == NULL) {
+    fprintf(stderr, "Could not write %s\n", output);
+    return 1;
+  }
+
+  perf_group_open(&counters);
+  fprintf(out, "{\n  \"reps\": %d,\n  \"images\": [\n", options.reps);
+  bool first = true;
+  for (int i = 0; i < count; i++) {
+    Image src = LoadImage(paths[i]);
+    if (src.data == NULL) {
+      fprintf(stderr, "Could not load %s\n", paths[i]);
+      continue;
+    }
+    ImageFormat(&src, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+
+    BenchOptions image_options = options;
+    if (image_options.seams >= src.width) {
+      image_options.seams = src.width - 1;
+    }
+    fprintf(stderr, "%s: %dx%d, %d seams\n", paths[i], src.width, src.height,
+            image_options.seams);
+
+    Samples samples[STAGES] = {0};
+    int runs = options.reps * (image_options.seams > 0 ? image_options.seams
+                                                       : 1);
+    for (int s = 0; s < STAGES; s++) {
+      samples[s].seconds = malloc(runs * sizeof(double));
+    }
+    BeamGap gap = {0};
+    bench_image(src, &image_options, samples, &gap);
+
+    fprintf(out,
+            "%s    {\n      \"name\": \"%s\",\n      \"width\": %d,\n"
+            "      \"height\": %d,\n      \"seams\": %d,\n"
+            "      \"stages\": {\n",
+            first ? "" : ",\n", base_name(paths[i]), src.width, src.height,
+            image_options.seams);
+    for (int s = 0; s < STAGES; s++) {
+      if (samples[s].perf.runs > 0) {
+        char summary[128];
+        perf_format(&samples[s].perf, summary, sizeof(summary));
+        fprintf(stderr, "  %s: %s\n", stage_names[s], summary);
+      }
+      if (samples[s].count > 0) {
+        bool last = s == STAGES - 1;
+        write_stage(out, s, &samples[s], last);
+      }
+    }
+    fprintf(out, "      }");
+    if (gap.count > 0) {
+      write_beam(out, options.beam, samples, &gap);
+    }
+    fprintf(out, "\n    }");
+    for (int s = 0; s < STAGES; s++) {
+      free(samples[s].seconds);
+    }
+    first = false;
+    UnloadImage(src);
+  }
+  fprintf(out, "\n  ]\n}\n");
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  globfree(&found);
+  perf_group_close(&counters);
+  return 0;
+}
@@ -0,0 +1,574 @@
+#include "check.h"
+
+#include <float.h>
+#include <math.h>
+#include <raylib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "carve.h"
+#include "libseam.h"
+#include "reference.h"
+#include "removal.h"
+#include "resample.h"
+#include "strips.h"
+
+// Error allowed between an energy and its reference, relative to the larger
+// of the two and one. Sobel sums terms up to 1020 that can cancel, leaving
+// an absolute error near one ulp of 1020 when the sums are reordered.
+#define TOLERANCE 1e-3
+
+typedef enum {
+  CHECK_LUMINANCE,
+  CHECK_SOBEL,
+  CHECK_DP,
+  CHECK_DP_AFTER_SEAM,
+  CHECK_BACKTRACK,
+  CHECK_TRACE,
+  CHECK_BAND,
+  CHECK_GUIDED,
+  CHECK_BEAM,
+  CHECK_SEAM,
+  CHECK_CARVE,
+  CHECK_STRIPS,
+  CHECK_RESAMPLE,
+  CHECK_REMOVAL,
+  CHECKS,
+} Check;
+
+static const char *check_names[CHECKS] = {
+    "luminance",    "sobel",     "dp",          "dp_after_seam", "backtrack",
+    "dp_row_trace", "band_seam", "guided_seam", "beam_seam",     "seam",
+    "carve",        "strips",    "resample",    "removal",
+};
+
+typedef struct {
+  long runs;
+  long failures;
+  // Seams that differ from the reference but cost the same, within the
+  // tolerance
+  long ties;
+  double max_error;
+} Result;
+
+typedef struct {
+  Result results[CHECKS];
+  // Failures of the image being checked, per check
+  long failed[CHECKS];
+} Checker;
+
+static void pass(Checker *c, Check check, bool ok, double error) {
+  Result *r = &c->results[check];
+  r->runs++;
+  r->max_error = error > r->max_error ? error : r->max_error;
+  if (!ok) {
+    r->failures++;
+    c->failed[check]++;
+  }
+}
+
+static void check_error(Checker *c, Check check, double error) {
+  pass(c, check, error <= TOLERANCE, error);
+}
+
+// Largest error of a against b, relative to b once b is past one
+static double mat_error(Mat a, Mat b) {
+  double worst = 0;
+  for (int y = 0; y < b.height; y++) {
+    for (int x = 0; x < b.width; x++) {
+      double want = MAT_AT(b, y, x, b.stride);
+      double error = fabs(MAT_AT(a, y, x, a.stride) - want);
+      error /= fabs(want) > 1 ? fabs(want) : 1;
+      worst = error > worst ? error : worst;
+    }
+  }
+  return worst;
+}
+
+static void mat_to_dense(Mat src, Mat *dst) {
+  dst->width = src.width;
+  dst->height = src.height;
+  for (int y = 0; y < src.height; y++) {
+    memcpy(&MAT_AT(*dst, y, 0, dst->stride), &MAT_AT(src, y, 0, src.stride),
+           src.width * sizeof(float));
+  }
+}
+
+static bool same_seam(const int *a, const int *b, int h) {
+  return memcmp(a, b, h * sizeof(int)) == 0;
+}
+
+static double seam_cost(Mat gradient, const int *seam) {
+  double cost = 0;
+  for (int y = 0; y < gradient.height; y++) {
+    cost += MAT_AT(gradient, y, seam[y], gradient.stride);
+  }
+  return cost;
+}
+
+static bool same_pixels(Image a, int a_stride, Image b, int b_stride) {
+  if (a.width != b.width || a.height != b.height) {
+    return false;
+  }
+  for (int y = 0; y < a.height; y++) {
+    if (memcmp(&((Color *)a.data)[y * a_stride],
+               &((Color *)b.data)[y * b_stride],
+               a.width * sizeof(Color)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Kept apart from img_transpose, which is under test through libseam
+static Image dense_transpose(Image src, int stride) {
+  Image dst = src;
+  dst.width = src.height;
+  dst.height = src.width;
+  dst.data = malloc((size_t)src.width * src.height * sizeof(Color));
+  for (int y = 0; y < src.height; y++) {
+    for (int x = 0; x < src.width; x++) {
+      ((Color *)dst.data)[x * dst.width + y] =
+          ((Color *)src.data)[y * stride + x];
+    }
+  }
+  return dst;
+}
+
+// Follows the backpointers of dp_row_trace the way the tiled mode does
+static void trace_seam(const float *last, const int8_t *trace, int w, int h,
+                       int *seam) {
+  seam[h - 1] = 0;
+  for (int x = 1; x < w; x++) {
+    if (last[x] < last[seam[h - 1]]) {
+      seam[h - 1] = x;
+    }
+  }
+  for (int y = h - 1; y > 0; y--) {
+    seam[y - 1] = seam[y] + trace[(size_t)y * w + seam[y]];
+  }
+}
+
+/*
+Removes seams columns from src with the engine and the reference side by
+side. Every stage of the engine is checked on the engine's own input, and the
+engine's seam against the one the reference finds on its own. Where the two
+tie the reference seam is removed from both, to keep them in step. Returns
+the reference result, dense, and whether there were ties.
+*/
+static bool lockstep(Checker *c, Image src, int src_stride, int seams,
+                     Image *out) {
+  int w = src.width;
+  int h = src.height;
+  int stride = img_stride_for(w);
+  Arena arena = arena_new(arena_bytes((size_t)stride * h, sizeof(Color)) +
+                          5 * mat_bytes(w, h) + beam_bytes(w, h, w));
+  Image img = img_new(&arena, w, h, stride);
+  img_copy(img, stride, src, src_stride);
+  Mat luminance = image_luminance(&arena, img, stride);
+  Mat gradient = mat_alloc(&arena, w, h, 0.0f);
+  sobel_filter(luminance, gradient);
+  Mat dp = mat_alloc(&arena, w, h, FLT_MAX);
+  // The DP of the previous seam, brought up to date after its removal
+  Mat updated = mat_alloc(&arena, w, h, FLT_MAX);
+  Mat scratch = mat_alloc(&arena, w, h, FLT_MAX);
+  Beam beam = beam_new(&arena, w, h, w);
+
+  Image ref = src;
+  ref.data = malloc((size_t)w * h * sizeof(Color));
+  ref = img_copy(ref, w, src, src_stride);
+  Mat ref_luminance_mat = ref_mat(w, h);
+  Mat ref_gradient = ref_mat(w, h);
+  Mat ref_dp_mat = ref_mat(w, h);
+  ref_luminance(ref, w, ref_luminance_mat);
+  ref_sobel(ref_luminance_mat, ref_gradient);
+
+  // Inputs and outputs of the reference kernels run on the engine's data
+  Mat input = ref_mat(w, h);
+  Mat want = ref_mat(w, h);
+  int *seam = malloc(h * sizeof(int));
+  int *want_seam = malloc(h * sizeof(int));
+  int *ref_seam_at = malloc(h * sizeof(int));
+  float *lines = malloc(2 * (w + 2) * sizeof(float));
+  int8_t *trace = malloc((size_t)w * h);
+  float *band_cost = malloc((size_t)w * h * sizeof(float));
+  int8_t *band_trace = malloc((size_t)w * h);
+
+  check_error(c, CHECK_LUMINANCE, mat_error(luminance, ref_luminance_mat));
+  mat_to_dense(luminance, &input);
+  ref_sobel(input, want);
+  check_error(c, CHECK_SOBEL, mat_error(gradient, want));
+
+  bool ties = false;
+  for (int s = 0; s < seams; s++) {
+    int cw = gradient.width;
+    dp.width = cw;
+    gradient_to_dp(gradient, dp);
+    mat_to_dense(gradient, &input);
+    want.width = cw;
+    ref_dp(input, want);
+    check_error(c, CHECK_DP, mat_error(dp, want));
+    if (s > 0) {
+      double error = mat_error(updated, dp);
+      pass(c, CHECK_DP_AFTER_SEAM, error == 0, error);
+    }
+
+    compute_seam(dp, seam);
+    mat_to_dense(dp, &input);
+    ref_seam(input, want_seam);
+    pass(c, CHECK_BACKTRACK, same_seam(seam, want_seam, h), 0);
+
+    // The tiled mode's row by row DP, two rows with ghosts at a time
+    float *prev = lines + 1;
+    float *cur = lines + w + 3;
+    prev[-1] = prev[cw] = cur[-1] = cur[cw] = FLT_MAX;
+    memcpy(prev, MAT_ROW(gradient, 0), cw * sizeof(float));
+    double error = 0;
+    for (int y = 1; y < h; y++) {
+      dp_row_trace(prev, MAT_ROW(gradient, y), cur, &trace[(size_t)y * cw],
+                   cw);
+      for (int x = 0; x < cw; x++) {
+        error = fmax(error, fabs(cur[x] - MAT_AT(dp, y, x, dp.stride)));
+      }
+      float *t = prev;
+      prev = cur;
+      cur = t;
+    }
+    trace_seam(prev, trace, cw, h, want_seam);
+    pass(c, CHECK_TRACE, error == 0 && same_seam(seam, want_seam, h), error);
+
+    // A band as wide as the image without a pull towards the guide is the
+    // full search
+    band_seam(gradient, seam, cw, 0.0f, band_cost, band_trace, want_seam);
+    pass(c, CHECK_BAND, same_seam(seam, want_seam, h), 0);
+    scratch.width = cw;
+    guided_seam(gradient, seam, cw, scratch, want_seam);
+    pass(c, CHECK_GUIDED, same_seam(seam, want_seam, h), 0);
+    // A beam as wide as the image keeps every path
+    beam_seam(&beam, gradient, want_seam);
+    pass(c, CHECK_BEAM, same_seam(seam, want_seam, h), 0);
+
+    ref_dp_mat.width = ref_gradient.width;
+    ref_dp(ref_gradient, ref_dp_mat);
+    ref_seam(ref_dp_mat, ref_seam_at);
+    if (same_seam(seam, ref_seam_at, h)) {
+      pass(c, CHECK_SEAM, true, 0);
+    } else {
+      double cost = seam_cost(ref_gradient, seam);
+      double best = seam_cost(ref_gradient, ref_seam_at);
+      double gap = fabs(cost - best) / (best > 1 ? best : 1);
+      c->results[CHECK_SEAM].ties += gap <= TOLERANCE;
+      ties = true;
+      check_error(c, CHECK_SEAM, gap);
+    }
+
+    updated = mat_copy(updated, dp);
+    for (int y = 0; y < h; y++) {
+      img_remove_column_at_row(img, y, ref_seam_at[y], stride);
+      mat_remove_column_at_row(gradient, y, ref_seam_at[y]);
+      mat_remove_column_at_row(updated, y, ref_seam_at[y]);
+    }
+    img.width--;
+    gradient.width--;
+    updated.width--;
+    dp_after_seam(gradient, updated, ref_seam_at);
+    ref_remove_seam(&ref, w, &ref_gradient, ref_seam_at);
+  }
+
+  // Packed, so that the result can be transposed and carved again
+  for (int y = 1; y < h; y++) {
+    memmove(&((Color *)ref.data)[y * ref.width],
+            &((Color *)ref.data)[y * w], ref.width * sizeof(Color));
+  }
+  *out = ref;
+
+  free(ref_luminance_mat.data);
+  free(ref_gradient.data);
+  free(ref_dp_mat.data);
+  free(input.data);
+  free(want.data);
+  free(seam);
+  free(want_seam);
+  free(ref_seam_at);
+  free(lines);
+  free(trace);
+  free(band_cost);
+  free(band_trace);
+  arena_destroy(&arena);
+  return ties;
+}
+
+// libseam on a copy of src, against the reference result want
+static void check_carve(Checker *c, SeamCtx *ctx, Image src, int tw, int th,
+                        Image want) {
+  size_t bytes = (size_t)src.width * src.height * sizeof(Color);
+  SeamImage image = {malloc(bytes), src.width, src.height, src.width};
+  memcpy(image.pixels, src.data, bytes);
+  bool ok = seam_ctx_carve(ctx, &image, tw, th) == SEAM_OK;
+
+  Image got = src;
+  got.data = image.pixels;
+  got.width = image.width;
+  got.height = image.height;
+  pass(c, CHECK_CARVE, ok && same_pixels(got, image.stride, want, want.width),
+       0);
+  free(image.pixels);
+}
+
+// Whether every row of got is the same row of src with pixels taken out
+static bool carved_from(Image got, Image src, int src_stride) {
+  for (int y = 0; y < got.height; y++) {
+    const Color *from = &((Color *)src.data)[y * src_stride];
+    const Color *row = &((Color *)got.data)[y * got.width];
+    int x = 0;
+    for (int i = 0; i < got.width; i++, x++) {
+      while (x < src.width && memcmp(&from[x], &row[i], sizeof(Color)) != 0) {
+        x++;
+      }
+      if (x == src.width) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+strips_carve on a copy of src, down to tw columns. In a single strip it is
+the whole carve and has to give the reference result want, when there is
+one; cut into strips the seams differ, but every row has to be left with
+tw of its own pixels, in order.
+*/
+static void check_strips(Checker *c, Image src, int tw, const Image *want) {
+  int w = src.width;
+  int h = src.height;
+  Arena arena = arena_new(arena_bytes((size_t)w * h, sizeof(Color)) +
+                          2 * mat_bytes(w, h) + strips_bytes(w, h, 4));
+  for (int strips = 1; strips <= 4; strips *= 4) {
+    StripPool *pool = strip_pool_new(strips);
+    arena_reset(&arena);
+    Image img = img_new(&arena, w, h, w);
+    img_copy(img, w, src, w);
+    Mat gradient = mat_alloc(&arena, w, h, 0.0f);
+    size_t mark = arena_mark(&arena);
+    sobel_filter(image_luminance(&arena, img, w), gradient);
+    arena_rewind(&arena, mark);
+
+    img = strips_carve(pool, &arena, img, w, &gradient, tw);
+    strip_pool_destroy(pool);
+    Color *pixels = img.data;
+    for (int y = 1; y < h; y++) {
+      memmove(&pixels[y * tw], &pixels[y * w], tw * sizeof(Color));
+    }
+    bool ok = img.width == tw && gradient.width == tw;
+    if (strips == 1 && want != NULL) {
+      pass(c, CHECK_STRIPS, ok && same_pixels(img, tw, *want, want->width),
+           0);
+    } else if (strips > 1) {
+      pass(c, CHECK_STRIPS, ok && carved_from(img, src, w), 0);
+    }
+  }
+  arena_destroy(&arena);
+}
+
+// Whether all the pixels of the row are the same
+static bool flat_row(const Color *row, int w) {
+  for (int x = 1; x < w; x++) {
+    if (memcmp(&row[x], &row[0], sizeof(Color)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+The resampler has no reference, but its weights have to add up to one: at
+the same width it gives back every pixel, and halving the width keeps flat
+rows as they were.
+*/
+static void check_resample(Checker *c, Image src) {
+  int w = src.width;
+  int h = src.height;
+  int half = (w + 1) / 2;
+  Arena arena = arena_new(arena_bytes((size_t)w * h, sizeof(Color)) +
+                          resampler_bytes(w, w) + resampler_bytes(w, half));
+  Image img = img_new(&arena, w, h, w);
+  img_copy(img, w, src, w);
+  Resampler same = resampler_new(&arena, w, w);
+  Resampler halve = resampler_new(&arena, w, half);
+
+  bool ok = true;
+  for (int y = 0; y < h; y++) {
+    resample_row(&same, &((Color *)img.data)[y * w]);
+  }
+  pass(c, CHECK_RESAMPLE, same_pixels(img, w, src, w), 0);
+  for (int y = 0; y < h; y++) {
+    const Color *from = &((Color *)src.data)[y * w];
+    Color *row = &((Color *)img.data)[y * w];
+    resample_row(&halve, row);
+    ok &= !flat_row(from, w) ||
+          (flat_row(row, half) && memcmp(row, from, sizeof(Color)) == 0);
+  }
+  pass(c, CHECK_RESAMPLE, ok, 0);
+  arena_destroy(&arena);
+}
+
+/*
+Object removal on a copy of src, with a protected column down the middle, a
+column to remove left of it in the top half and one right of it in the
+bottom half. A seam down both would cross the protected column once to take
+twice the pixels to remove. Every pixel to remove has to go and every
+protected one to stay.
+*/
+static void check_removal(Checker *c, Image src) {
+  int w = src.width;
+  int h = src.height;
+  if (w < 3) {
+    return;
+  }
+  Arena arena = arena_new(arena_bytes((size_t)w * h, sizeof(Color)) +
+                          2 * mask_bytes(w, h) + removal_bytes(w, h));
+  Image img = img_new(&arena, w, h, w);
+  img_copy(img, w, src, w);
+  Mask protect = mask_alloc(&arena, w, h);
+  Mask remove = mask_alloc(&arena, w, h);
+  int x = w / 2;
+  for (int y = 0; y < h; y++) {
+    int r = y < h / 2 ? x - 1 : x + 1;
+    MASK_ROW(protect, y)[x / 64] |= (uint64_t)1 << x % 64;
+    MASK_ROW(remove, y)[r / 64] |= (uint64_t)1 << r % 64;
+  }
+
+  bool ok = removal_carve(&arena, &img, w, &protect, &remove) &&
+            mask_count(remove) == 0 && mask_count(protect) == h;
+  Color *pixels = img.data;
+  for (int y = 1; y < h; y++) {
+    memmove(&pixels[y * img.width], &pixels[y * w],
+            img.width * sizeof(Color));
+  }
+  pass(c, CHECK_REMOVAL, ok && carved_from(img, src, w), 0);
+  arena_destroy(&arena);
+}
+
+/*
+Columns are carved first and rows after them, from the transposed result, as
+libseam does. A whole carve is only compared once the engine and the
+reference agreed on every seam.
+*/
+static void check_image(Checker *c, SeamCtx *ctx, Image src, int seams) {
+  int w = src.width;
+  int h = src.height;
+  int columns = seams < w ? seams : w - 1;
+  int rows = seams < h ? seams : h - 1;
+
+  Image carved;
+  bool ties = lockstep(c, src, w, columns, &carved);
+  if (!ties) {
+    check_carve(c, ctx, src, w - columns, 0, carved);
+  }
+  check_strips(c, src, w - columns, ties ? NULL : &carved);
+  check_resample(c, src);
+  check_removal(c, src);
+
+  Image turned = dense_transpose(carved, carved.width);
+  Image turned_carved;
+  ties |= lockstep(c, turned, turned.width, rows, &turned_carved);
+  Image want = dense_transpose(turned_carved, turned_carved.width);
+  if (!ties) {
+    check_carve(c, ctx, src, w - columns, h - rows, want);
+  }
+
+  free(carved.data);
+  free(turned.data);
+  free(turned_carved.data);
+  free(want.data);
+}
+
+// Noise, a flat colour, which ties everywhere, or a checkerboard, which ties
+// in places
+static Image random_image(unsigned *seed) {
+  int w = 1 + rand_r(seed) % 160;
+  int h = 1 + rand_r(seed) % 160;
+  int kind = rand_r(seed) % 3;
+  int block = 1 + rand_r(seed) % 16;
+  Image img = {
+      .data = malloc((size_t)w * h * sizeof(Color)),
+      .width = w,
+      .height = h,
+      .mipmaps = 1,
+      .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+  };
+  Color flat = {rand_r(seed), rand_r(seed), rand_r(seed), 255};
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      Color *p = &((Color *)img.data)[y * w + x];
+      if (kind == 0) {
+        *p = (Color){rand_r(seed), rand_r(seed), rand_r(seed), 255};
+      } else if (kind == 1) {
+        *p = flat;
+      } else {
+        unsigned char v = (x / block + y / block) % 2 ? 200 : 30;
+        *p = (Color){v, v, v, 255};
+      }
+    }
+  }
+  return img;
+}
+
+static void report_image(Checker *c, const char *name, Image img) {
+  printf("%-24s %5dx%-5d", name, img.width, img.height);
+  bool ok = true;
+  for (int k = 0; k < CHECKS; k++) {
+    if (c->failed[k] > 0) {
+      printf("%s %s (%ld)", ok ? " FAILED:" : ",", check_names[k],
+             c->failed[k]);
+      ok = false;
+    }
+    c->failed[k] = 0;
+  }
+  printf("%s\n", ok ? " ok" : "");
+}
+
+bool check_run(const CheckOptions *options) {
+  Checker c = {0};
+  SeamCtx *ctx = seam_ctx_create(NULL);
+
+  for (int i = 0; i < options->count; i++) {
+    Image src = LoadImage(options->paths[i]);
+    if (src.data == NULL) {
+      fprintf(stderr, "Could not load %s\n", options->paths[i]);
+      continue;
+    }
+    ImageFormat(&src, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    check_image(&c, ctx, src, options->seams);
+    const char *name = strrchr(options->paths[i], '/');
+    report_image(&c, name != NULL ? name + 1 : options->paths[i], src);
+    UnloadImage(src);
+  }
+
+  unsigned seed = options->seed;
+  for (int i = 0; i < options->randoms; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "random %u", seed);
+    unsigned image_seed = seed;
+    Image src = random_image(&image_seed);
+    check_image(&c, ctx, src, options->seams);
+    report_image(&c, name, src);
+    free(src.data);
+    seed++;
+  }
+  seam_ctx_destroy(ctx);
+
+  bool ok = true;
+  printf("\n%-14s %8s %8s %6s %10s\n", "check", "runs", "failed", "ties",
+         "max error");
+  for (int k = 0; k < CHECKS; k++) {
+    const Result *r = &c.results[k];
+    printf("%-14s %8ld %8ld %6ld %10.2g\n", check_names[k], r->runs,
+           r->failures, r->ties, r->max_error);
+    ok &= r->failures == 0;
+  }
+  return ok;
+}
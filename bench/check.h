@@ -0,0 +1,25 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdbool.h>
+
+/*
+Differential checks of the engine against the reference kernels, on the
+given images and on random ones. Every optimized path runs on the same input
+as its reference. Energies have to agree within a relative tolerance, seams
+exactly. Whole carves through libseam have to give the same pixels as
+the reference carving the same seams, and object removal has to take every
+pixel to remove and leave every protected one.
+*/
+typedef struct {
+  char **paths;
+  int count;
+  int seams;
+  int randoms;
+  unsigned seed;
+} CheckOptions;
+
+// True when every check passed. Prints a line per image and a summary.
+bool check_run(const CheckOptions *options);
+
+#endif // CHECK_H
@@ -0,0 +1,134 @@
+#include "reference.h"
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static float sobel_x[3][3] = {
+    {-1, 0, 1},
+    {-2, 0, 2},
+    {-1, 0, 1},
+};
+
+static float sobel_y[3][3] = {
+    {-1, -2, -1},
+    {0, 0, 0},
+    {1, 2, 1},
+};
+
+Mat ref_mat(int w, int h) {
+  Mat mat = {0};
+  mat.width = w;
+  mat.height = h;
+  mat.stride = w;
+  mat.data = calloc((size_t)w * h, sizeof(*mat.data));
+  assert(mat.data != NULL);
+  return mat;
+}
+
+// Human perception of brightness according to ITU-R BT.709
+static float rgb_to_luminance(Color c) {
+  return 0.299 * c.r + 0.587 * c.g + 0.114 * c.b;
+}
+
+void ref_luminance(Image img, int stride, Mat out) {
+  for (int y = 0; y < img.height; y++) {
+    for (int x = 0; x < img.width; x++) {
+      Color c = ((Color *)img.data)[y * stride + x];
+      MAT_AT(out, y, x, out.stride) = rgb_to_luminance(c);
+    }
+  }
+}
+
+static float sobel_filter_at(Mat img, int cx, int cy) {
+  float sx = 0.0f;
+  float sy = 0.0f;
+
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      int x = cx + dx;
+      int y = cy + dy;
+      float c = MAT_WITHIN(img, y, x) ? MAT_AT(img, y, x, img.stride) : 0.0;
+      sx += c * sobel_x[dy + 1][dx + 1];
+      sy += c * sobel_y[dy + 1][dx + 1];
+    }
+  }
+
+  return sqrtf(sx * sx + sy * sy);
+}
+
+void ref_sobel(Mat img, Mat gradient) {
+  assert(img.width == gradient.width);
+  assert(img.height == gradient.height);
+
+  for (int cy = 0; cy < img.height; cy++) {
+    for (int cx = 0; cx < img.width; cx++) {
+      MAT_AT(gradient, cy, cx, gradient.stride) = sobel_filter_at(img, cx, cy);
+    }
+  }
+}
+
+void ref_dp(Mat gradient, Mat dp) {
+  assert(dp.width == gradient.width);
+  assert(dp.height == gradient.height);
+
+  for (int x = 0; x < gradient.width; x++) {
+    // First row is a given
+    MAT_AT(dp, 0, x, dp.stride) = MAT_AT(gradient, 0, x, gradient.stride);
+  }
+
+  for (int y = 1; y < gradient.height; y++) {
+    for (int cx = 0; cx < gradient.width; cx++) {
+      // Compute minimal value moving down left, down or down right
+      float m = FLT_MAX;
+      for (int dx = -1; dx <= 1; dx++) {
+        int x = cx + dx;
+        float c = (0 <= x && x < gradient.width)
+                      ? MAT_AT(dp, y - 1, x, dp.stride)
+                      : FLT_MAX;
+        if (c < m)
+          m = c;
+      }
+      MAT_AT(dp, y, cx, dp.stride) =
+          MAT_AT(gradient, y, cx, gradient.stride) + m;
+    }
+  }
+}
+
+void ref_seam(Mat dp, int *seam) {
+  int y = dp.height - 1;
+  seam[y] = 0;
+
+  // Get minimum value at the last row
+  for (int x = 1; x < dp.width; x++) {
+    if (MAT_AT(dp, y, x, dp.stride) < MAT_AT(dp, y, seam[y], dp.stride)) {
+      seam[y] = x;
+    }
+  }
+
+  for (y = dp.height - 2; y >= 0; y--) {
+    seam[y] = seam[y + 1]; // previous value
+    for (int dx = -1; dx <= 1; dx++) {
+      int x = seam[y + 1] + dx;
+      if ((0 <= x && x < dp.width) &&
+          MAT_AT(dp, y, x, dp.stride) < MAT_AT(dp, y, seam[y], dp.stride)) {
+        seam[y] = x;
+      }
+    }
+  }
+}
+
+void ref_remove_seam(Image *img, int stride, Mat *gradient, const int *seam) {
+  for (int y = 0; y < img->height; y++) {
+    int x = seam[y];
+    Color *pixels = &((Color *)img->data)[y * stride];
+    memmove(pixels + x, pixels + x + 1,
+            (img->width - x - 1) * sizeof(Color));
+    float *row = &MAT_AT(*gradient, y, 0, gradient->stride);
+    memmove(row + x, row + x + 1, (gradient->width - x - 1) * sizeof(float));
+  }
+  img->width--;
+  gradient->width--;
+}
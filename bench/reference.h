@@ -0,0 +1,21 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include "carve.h"
+
+/*
+The kernels as they were first written: one pixel at a time, every
+neighbour bounds checked, on dense Mats with no ghost border. Slow and
+plainly right, they are what every faster path is checked against, and are
+not to be optimized.
+*/
+
+// A dense Mat, stride equal to the width, from malloc
+Mat ref_mat(int w, int h);
+void ref_luminance(Image img, int stride, Mat out);
+void ref_sobel(Mat luminance, Mat gradient);
+void ref_dp(Mat gradient, Mat dp);
+void ref_seam(Mat dp, int *seam);
+void ref_remove_seam(Image *img, int stride, Mat *gradient, const int *seam);
+
+#endif // REFERENCE_H
@@ -3,8 +3,19 @@
 set -xe
 
 CFLAGS="-Wall -Wextra -ggdb -Ofast`pkg-config --cflags raylib`"
-LIBS="`pkg-config --libs raylib` -lm"
+LIBS="`pkg-config --libs raylib` -lm -lpthread"
 
 clang $CFLAGS -o ./seam ./*.c $LIBS -L./bin/
+clang $CFLAGS -I. -o ./seam-bench ./bench/bench.c ./bench/check.c \
+  ./bench/reference.c ./arena.c ./carve.c ./libseam.c ./perf.c ./rawio.c \
+  ./removal.c ./resample.c ./strips.c ./trace.c $LIBS -L./bin/
+
+# The engine alone, as libseam.a and libseam.so, for use through libseam.h
+mkdir -p ./bin/libseam
+for src in arena carve libseam trace; do
+  clang $CFLAGS -fPIC -fvisibility=hidden -c -o ./bin/libseam/$src.o ./$src.c
+done
+ar rcs ./bin/libseam.a ./bin/libseam/*.o
+clang -shared -o ./bin/libseam.so ./bin/libseam/*.o -lm -lpthread
 
 ./seam $1
@@ -0,0 +1,785 @@
+#include "carve.h"
+
+#include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Side of the square blocks transposes go through, so that the rows read and
+// the rows written both stay within a few cache lines
+#define TRANSPOSE_BLOCK 16
+
+// Rows ahead of the one being searched that beam_seam fetches into the cache
+#define BEAM_PREFETCH 8
+
+static float sobel_x[3][3] = {
+    {-1, 0, 1},
+    {-2, 0, 2},
+    {-1, 0, 1},
+};
+
+static float sobel_y[3][3] = {
+    {-1, -2, -1},
+    {0, 0, 0},
+    {1, 2, 1},
+};
+
+int mat_stride(int w) {
+  return (MAT_ALIGN + w + 1 + MAT_ALIGN - 1) / MAT_ALIGN * MAT_ALIGN;
+}
+
+// Pixels outside the image read as zero from the ghost border
+static float sobel_filter_at(const float *rows[3], int cx) {
+  float sx = 0.0f;
+  float sy = 0.0f;
+
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      float c = rows[dy + 1][cx + dx];
+      sx += c * sobel_x[dy + 1][dx + 1];
+      sy += c * sobel_y[dy + 1][dx + 1];
+    }
+  }
+
+  return sqrtf(sx * sx + sy * sy);
+}
+
+void sobel_row(const float *above, const float *row, const float *below,
+               float *out, int width) {
+  const float *rows[3] = {above, row, below};
+  for (int cx = 0; cx < width; cx++) {
+    out[cx] = sobel_filter_at(rows, cx);
+  }
+}
+
+void sobel_filter(Mat img, Mat gradient) {
+  assert(img.width == gradient.width);
+  assert(img.height == gradient.height);
+
+  for (int cy = 0; cy < img.height; cy++) {
+    sobel_row(MAT_ROW(img, cy - 1), MAT_ROW(img, cy), MAT_ROW(img, cy + 1),
+              MAT_ROW(gradient, cy), img.width);
+  }
+}
+
+// Same as sobel_row, except that protected pixels cost excluded and pixels
+// to be removed bonus less, read from the bits of the row of each mask
+void sobel_row_masked(const float *above, const float *row, const float *below,
+                      const uint64_t *protect, const uint64_t *remove,
+                      float excluded, float bonus, float *out, int width) {
+  const float *rows[3] = {above, row, below};
+  for (int cx = 0; cx < width; cx++) {
+    bool p = protect[cx / 64] >> (cx % 64) & 1;
+    float r = remove[cx / 64] >> (cx % 64) & 1;
+    out[cx] = p ? excluded : sobel_filter_at(rows, cx) - bonus * r;
+  }
+}
+
+/*
+The masks are applied as the energy is computed rather than added to it in
+another pass. A protected pixel costs more than any seam free of them can,
+whatever its bonuses, so that a seam only crosses one when every seam has
+to. A whole seam of them, down or across, still adds up to less than the
+FLT_MAX of the DP's ghost columns.
+
+Each pixel to be removed costs bonus less. From SOBEL_MAX * (height + 1) up,
+any seam through one beats every seam that misses them all, but seams
+through many of them then add up to sums too large for a float to tell
+their Sobel energies apart.
+*/
+void sobel_filter_masked(Mat img, Mat gradient, Mask protect, Mask remove,
+                         float bonus) {
+  assert(img.width == gradient.width);
+  assert(img.height == gradient.height);
+  assert(protect.width == img.width && protect.height == img.height);
+  assert(remove.width == img.width && remove.height == img.height);
+
+  float excluded = FLT_MAX / (2.0f * (img.width + img.height + 1));
+  for (int cy = 0; cy < img.height; cy++) {
+    sobel_row_masked(MAT_ROW(img, cy - 1), MAT_ROW(img, cy),
+                     MAT_ROW(img, cy + 1), MASK_ROW(protect, cy),
+                     MASK_ROW(remove, cy), excluded, bonus,
+                     MAT_ROW(gradient, cy), img.width);
+  }
+}
+
+// Human perception of brightness according to ITU-R BT.709
+static float rgb_to_luminance(Color c) {
+  return 0.299 * c.r + 0.587 * c.g + 0.114 * c.b;
+}
+
+void luminance_row(const Color *pixels, float *out, int width) {
+  for (int x = 0; x < width; x++) {
+    out[x] = rgb_to_luminance(pixels[x]);
+  }
+}
+
+/*
+
+The optimal seam can be found using dynamic programming. The
+first step is to traverse the image from the second row to the last row
+and compute the cumulative minimum energy M for all possible
+connected seams for each entry (i, j):
+
+M(i, j) = e(i, j)+ min(M(i−1, j −1),M(i−1, j),M(i−1, j +1))
+
+ */
+
+// Compute minimal value moving down left, down or down right
+static inline float dp_parent(const float *prev, int cx) {
+  float m = prev[cx - 1];
+  if (prev[cx] < m)
+    m = prev[cx];
+  if (prev[cx + 1] < m)
+    m = prev[cx + 1];
+  return m;
+}
+
+void dp_row(const float *prev, const float *energy, float *out, int width) {
+  for (int cx = 0; cx < width; cx++) {
+    out[cx] = energy[cx] + dp_parent(prev, cx);
+  }
+}
+
+/*
+Same as dp_row, but also records which of the three parents was taken, as an
+offset in [-1, 1]. Ties are broken the way compute_seam breaks them: straight
+up first, then left, then right.
+*/
+void dp_row_trace(const float *prev, const float *energy, float *out,
+                  int8_t *trace, int width) {
+  for (int cx = 0; cx < width; cx++) {
+    float m = prev[cx];
+    int8_t t = 0;
+    if (prev[cx - 1] < m) {
+      m = prev[cx - 1];
+      t = -1;
+    }
+    if (prev[cx + 1] < m) {
+      m = prev[cx + 1];
+      t = 1;
+    }
+    out[cx] = energy[cx] + m;
+    trace[cx] = t;
+  }
+}
+
+void gradient_to_dp(Mat gradient, Mat dp) {
+  assert(dp.width == gradient.width);
+  assert(dp.height == gradient.height);
+
+  // The width shrinks as seams are removed, so the right ghost column moves
+  for (int y = 0; y < dp.height; y++) {
+    MAT_AT(dp, y, -1, dp.stride) = FLT_MAX;
+    MAT_AT(dp, y, dp.width, dp.stride) = FLT_MAX;
+  }
+
+  for (int x = 0; x < gradient.width; x++) {
+    // First row is a given
+    MAT_AT(dp, 0, x, dp.stride) = MAT_AT(gradient, 0, x, gradient.stride);
+  }
+
+  for (int y = 1; y < gradient.height; y++) {
+    dp_row(MAT_ROW(dp, y - 1), MAT_ROW(gradient, y), MAT_ROW(dp, y),
+           gradient.width);
+  }
+}
+
+/*
+Brings dp up to date once seam has been removed from both gradient and dp,
+with mat_remove_column_at_row, instead of running gradient_to_dp again. The
+cells next to the seam lost a parent, and the cells below any cell whose
+value changed have to follow; everything else keeps its value. The cells to
+compute again form a band around the seam that stops widening wherever
+values come out the same, so this costs a fraction of the whole DP and gives
+exactly the same result.
+*/
+void dp_after_seam(Mat gradient, Mat dp, const int *seam) {
+  assert(dp.width == gradient.width);
+  assert(dp.height == gradient.height);
+
+  int w = dp.width;
+  // Columns of the row above that changed, empty when lo > hi
+  int lo = w;
+  int hi = -1;
+  for (int y = 1; y < dp.height; y++) {
+    int a = seam[y - 1] < seam[y] ? seam[y - 1] : seam[y];
+    int b = seam[y - 1] > seam[y] ? seam[y - 1] : seam[y];
+    int x0 = lo - 1 < a - 1 ? lo - 1 : a - 1;
+    int x1 = hi + 1 > b ? hi + 1 : b;
+    x0 = x0 > 0 ? x0 : 0;
+    x1 = x1 < w - 1 ? x1 : w - 1;
+
+    const float *prev = MAT_ROW(dp, y - 1);
+    const float *energy = MAT_ROW(gradient, y);
+    float *out = MAT_ROW(dp, y);
+    lo = w;
+    hi = -1;
+    for (int cx = x0; cx <= x1; cx++) {
+      float value = energy[cx] + dp_parent(prev, cx);
+      if (value != out[cx]) {
+        out[cx] = value;
+        lo = lo < cx ? lo : cx;
+        hi = cx;
+      }
+    }
+  }
+}
+
+/*
+At the end of this process, the minimum value of the last row in
+M will indicate the end of the minimal connected vertical seam.
+Hence, in the second step we backtrack from this minimum entry on
+M to find the path of the optimal seam (see Figure 1). The definition
+of M for horizontal seams is similar
+*/
+
+void compute_seam(Mat dp, int *seam) {
+  int y = dp.height - 1;
+  seam[y] = 0;
+
+  // Get minimum value at the last row
+  for (int x = 1; x < dp.width; x++) {
+    if (MAT_AT(dp, y, x, dp.stride) < MAT_AT(dp, y, seam[y], dp.stride)) {
+      seam[y] = x;
+    }
+  }
+
+  // The ghost columns hold FLT_MAX, so they never win
+  for (y = dp.height - 2; y >= 0; y--) {
+    seam[y] = seam[y + 1]; // previous value
+    for (int dx = -1; dx <= 1; dx++) {
+      int x = seam[y + 1] + dx;
+      if (MAT_AT(dp, y, x, dp.stride) < MAT_AT(dp, y, seam[y], dp.stride)) {
+        seam[y] = x;
+      }
+    }
+  }
+}
+
+// What removing seam takes out of the image, the sum of its gradient
+float seam_energy(Mat gradient, const int *seam) {
+  float energy = 0.0f;
+  for (int y = 0; y < gradient.height; y++) {
+    energy += MAT_AT(gradient, y, seam[y], gradient.stride);
+  }
+  return energy;
+}
+
+static int band_start(int guide, int radius, int band, int width) {
+  int lo = guide - radius;
+  lo = lo < width - band ? lo : width - band;
+  return lo > 0 ? lo : 0;
+}
+
+/*
+Seam search limited to a band around a guide seam the answer is known to be
+close to, such as the same seam in the previous frame of a video. Row y only
+looks at the 2 * radius + 1 columns around guide[y], and every column away
+from the guide costs coherence on top of the energy. cost and trace need
+room for height * (2 * radius + 1) entries.
+*/
+void band_seam(Mat gradient, const int *guide, int radius, float coherence,
+               float *cost, int8_t *trace, int *seam) {
+  int w = gradient.width;
+  int h = gradient.height;
+  int band = 2 * radius + 1 < w ? 2 * radius + 1 : w;
+
+  int prev_lo = 0;
+  for (int y = 0; y < h; y++) {
+    int lo = band_start(guide[y], radius, band, w);
+    const float *energy = MAT_ROW(gradient, y);
+    float *row = &cost[(size_t)y * band];
+    const float *above = row - band;
+    int8_t *steps = &trace[(size_t)y * band];
+
+    for (int i = 0; i < band; i++) {
+      int x = lo + i;
+      float e = energy[x] + coherence * abs(x - guide[y]);
+      if (y == 0) {
+        row[i] = e;
+        continue;
+      }
+
+      // Same preference as compute_seam: down, then down left, then down
+      // right. Columns outside the band above cannot be reached.
+      int j = x - prev_lo;
+      float m = FLT_MAX;
+      int8_t step = 0;
+      if (0 <= j && j < band) {
+        m = above[j];
+      }
+      if (0 < j && j <= band && above[j - 1] < m) {
+        m = above[j - 1];
+        step = -1;
+      }
+      if (-1 <= j && j < band - 1 && above[j + 1] < m) {
+        m = above[j + 1];
+        step = 1;
+      }
+      row[i] = e + m;
+      steps[i] = step;
+    }
+    prev_lo = lo;
+  }
+
+  int lo = band_start(guide[h - 1], radius, band, w);
+  const float *last = &cost[(size_t)(h - 1) * band];
+  int best = 0;
+  for (int i = 1; i < band; i++) {
+    if (last[i] < last[best]) {
+      best = i;
+    }
+  }
+
+  seam[h - 1] = lo + best;
+  for (int y = h - 1; y > 0; y--) {
+    lo = band_start(guide[y], radius, band, w);
+    seam[y - 1] = seam[y] + trace[(size_t)y * band + seam[y] - lo];
+  }
+}
+
+/*
+Seam search limited to the columns within radius of a guide path that moves
+by at most one column from row to row, on the same dp_row and compute_seam
+as the full search. dp is a full size scratch Mat of which only the band is
+written, fenced by FLT_MAX two cells out on either side: wide enough for the
+band of the next row, which is at most one column off, to read from.
+*/
+void guided_seam(Mat gradient, const int *guide, int radius, Mat dp,
+                 int *seam) {
+  assert(dp.width == gradient.width);
+  assert(dp.height == gradient.height);
+
+  int w = gradient.width;
+  int lo = 0;
+  int hi = w - 1;
+  for (int y = 0; y < gradient.height; y++) {
+    assert(y == 0 || abs(guide[y] - guide[y - 1]) <= 1);
+    lo = guide[y] - radius > 0 ? guide[y] - radius : 0;
+    hi = guide[y] + radius < w - 1 ? guide[y] + radius : w - 1;
+    float *row = MAT_ROW(dp, y);
+    for (int x = lo - 2; x < lo; x++) {
+      row[x > -1 ? x : -1] = FLT_MAX;
+    }
+    for (int x = hi + 1; x <= hi + 2; x++) {
+      row[x < w ? x : w] = FLT_MAX;
+    }
+
+    const float *energy = MAT_ROW(gradient, y);
+    if (y == 0) {
+      memcpy(&row[lo], &energy[lo], (hi - lo + 1) * sizeof(float));
+    } else {
+      dp_row(&MAT_ROW(dp, y - 1)[lo], &energy[lo], &row[lo], hi - lo + 1);
+    }
+  }
+
+  // The backtrack never leaves the band, but the last row is searched whole
+  float *last = MAT_ROW(dp, dp.height - 1);
+  for (int x = 0; x < w; x++) {
+    last[x] = lo <= x && x <= hi ? last[x] : FLT_MAX;
+  }
+  compute_seam(dp, seam);
+}
+
+// The columns and costs of a row of paths are followed by two more, looked at
+// as the neighbours of the last paths kept
+size_t beam_bytes(int w, int h, int beam) {
+  return arena_bytes((size_t)h * beam + 2, sizeof(int)) +
+         arena_bytes((size_t)h * beam, sizeof(int)) +
+         2 * arena_bytes(beam + 2, sizeof(float)) +
+         arena_bytes(w, sizeof(int)) +
+         2 * arena_bytes((size_t)3 * beam, sizeof(int)) +
+         arena_bytes((size_t)3 * beam, sizeof(float));
+}
+
+Beam beam_new(Arena *arena, int w, int h, int beam) {
+  assert(beam > 0);
+  return (Beam){
+      .beam = beam,
+      .columns = arena_alloc(arena, (size_t)h * beam + 2, sizeof(int)),
+      .parents = arena_alloc(arena, (size_t)h * beam, sizeof(int)),
+      .cost = arena_alloc(arena, beam + 2, sizeof(float)),
+      .next_cost = arena_alloc(arena, beam + 2, sizeof(float)),
+      .slice_of = arena_alloc(arena, w, sizeof(int)),
+      .grown = arena_alloc(arena, (size_t)3 * beam, sizeof(int)),
+      .grown_parents = arena_alloc(arena, (size_t)3 * beam, sizeof(int)),
+      .grown_cost = arena_alloc(arena, (size_t)3 * beam, sizeof(float)),
+  };
+}
+
+// Adds column x, reached by path parent at cost, to the columns grown into
+// so far, k of them, unless a path before reached it first or it is past the
+// width. Returns how many there are now.
+static inline int beam_grow(Beam *b, int k, int *last, int w, int x,
+                            int parent, float cost) {
+  b->grown[k] = x;
+  b->grown_parents[k] = parent;
+  b->grown_cost[k] = cost;
+  bool fresh = (x > *last) & (x < w);
+  *last = fresh ? x : *last;
+  return k + fresh;
+}
+
+// Keeps for every slice the cheapest of the k columns grown into it, which
+// come in order, and returns how many slices were reached. Ties go to the
+// column on the left. The two columns after those kept are set too far right
+// to reach anything.
+static inline int beam_keep(const Beam *b, int k, int *columns, int *parents,
+                            float *cost) {
+  int m = 0;
+  int slice = -1;
+  float best = FLT_MAX;
+  int best_x = 0;
+  int best_parent = 0;
+  for (int i = 0; i < k; i++) {
+    int x = b->grown[i];
+    float value = b->grown_cost[i];
+    bool fresh = b->slice_of[x] != slice;
+    slice = b->slice_of[x];
+    m += fresh;
+
+    // The best so far is stored every time, so that none of it branches
+    best = fresh ? FLT_MAX : best;
+    bool better = value < best;
+    best = better ? value : best;
+    best_x = better ? x : best_x;
+    best_parent = better ? b->grown_parents[i] : best_parent;
+    cost[m - 1] = best;
+    columns[m - 1] = best_x;
+    parents[m - 1] = best_parent;
+  }
+  columns[m] = INT_MAX;
+  columns[m + 1] = INT_MAX;
+  return m;
+}
+
+/*
+Approximate seam search that follows a few paths down the gradient instead
+of running the DP over every pixel. The columns are split into beam slices,
+and each row every slice keeps only the cheapest path that ends in it: the
+paths kept grow into the columns below them, each column taking the
+cheapest path that reaches it with the same preference as compute_seam.
+Keeping a path per slice, rather than the cheapest paths overall, keeps
+them spread over the width of the image instead of crowding into one low
+valley. A beam as wide as the image is the DP itself and finds the same
+seam; a narrow one does a few times beam work per row rather than width,
+with selects in place of branches, since which path wins is down to the
+image.
+*/
+void beam_seam(Beam *b, Mat gradient, int *seam) {
+  int w = gradient.width;
+  int h = gradient.height;
+  int slices = b->beam < w ? b->beam : w;
+
+  // Slice s holds the columns x with x * slices / w == s
+  for (int s = 0; s < slices; s++) {
+    int from = ((long)s * w + slices - 1) / slices;
+    int to = ((long)(s + 1) * w + slices - 1) / slices;
+    for (int x = from; x < to; x++) {
+      b->slice_of[x] = s;
+    }
+  }
+
+  // The first row starts from the cheapest column of every slice
+  const float *energy = MAT_ROW(gradient, 0);
+  int n = 0;
+  for (int x = 0; x < w; x++) {
+    if (n == b->slice_of[x]) {
+      b->cost[n] = energy[x];
+      b->columns[n] = x;
+      b->parents[n++] = -1;
+    } else if (energy[x] < b->cost[n - 1]) {
+      b->cost[n - 1] = energy[x];
+      b->columns[n - 1] = x;
+    }
+  }
+  b->columns[n] = INT_MAX;
+  b->columns[n + 1] = INT_MAX;
+
+  for (int y = 1; y < h; y++) {
+    const int *above = &b->columns[(size_t)(y - 1) * b->beam];
+    const float *paths = b->cost;
+    energy = MAT_ROW(gradient, y);
+
+    // Every path grows into the three columns below it, and as the paths
+    // are in order so are these. Only the first path to grow into a column
+    // counts it, and the paths that reach it are among that one and the two
+    // after.
+    int k = 0;
+    int last = -1;
+    for (int j = 0; j < n; j++) {
+      // The cost of the path at column x + d and which one it is, FLT_MAX
+      // where there is none, the last entry standing for any further right
+      int x = above[j];
+      int d1 = above[j + 1] - x < 3 ? above[j + 1] - x : 3;
+      int d2 = above[j + 2] - x < 3 ? above[j + 2] - x : 3;
+      float near[4] = {paths[j], FLT_MAX, FLT_MAX, FLT_MAX};
+      int path[4] = {j, j, j, j};
+      near[d2] = paths[j + 2];
+      path[d2] = j + 2;
+      near[d1] = paths[j + 1];
+      path[d1] = j + 1;
+
+      // From the right alone
+      k = beam_grow(b, k, &last, w, x - 1, j, near[0] + energy[x - 1]);
+
+      // Straight down first, then from the right
+      bool right = near[1] < near[0];
+      k = beam_grow(b, k, &last, w, x, right ? path[1] : j,
+                    (right ? near[1] : near[0]) + energy[x]);
+
+      // Straight down first, then from the left, then from the right
+      float cost = near[1];
+      int parent = path[1];
+      parent = near[0] < cost ? j : parent;
+      cost = near[0] < cost ? near[0] : cost;
+      parent = near[2] < cost ? path[2] : parent;
+      cost = near[2] < cost ? near[2] : cost;
+      k = beam_grow(b, k, &last, w, x + 1, parent, cost + energy[x + 1]);
+    }
+
+    int *columns = &b->columns[(size_t)y * b->beam];
+    float *cost = b->next_cost;
+    n = beam_keep(b, k, columns, &b->parents[(size_t)y * b->beam], cost);
+    b->next_cost = b->cost;
+    b->cost = cost;
+
+    // A path moves a column a row at most, so its energy a few rows down is
+    // on the same cache line or the next. Rows are too far apart in memory
+    // for the hardware to see it coming.
+    if (y + BEAM_PREFETCH < h) {
+      const float *ahead = MAT_ROW(gradient, y + BEAM_PREFETCH);
+      for (int i = 0; i < n; i++) {
+        __builtin_prefetch(&ahead[columns[i]]);
+      }
+    }
+  }
+
+  int best = 0;
+  for (int i = 1; i < n; i++) {
+    best = b->cost[i] < b->cost[best] ? i : best;
+  }
+  for (int y = h - 1; y >= 0; y--) {
+    seam[y] = b->columns[(size_t)y * b->beam + best];
+    best = b->parents[(size_t)y * b->beam + best];
+  }
+}
+
+void img_remove_column_at_row(Image img, int y, int x, int stride) {
+  Color *data = img.data;
+  Color *pixel_row = &data[y * stride];
+  memmove(pixel_row + x, pixel_row + x + 1,
+          (img.width - x - 1) * sizeof(Color));
+}
+
+// Shifts the right ghost column along with the pixels, so the border stays
+// in place right after the new last column.
+void mat_remove_column_at_row(Mat mat, int row, int column) {
+  float *pixel_row = &MAT_AT(mat, row, 0, mat.stride);
+  memmove(pixel_row + column, pixel_row + column + 1,
+          (mat.width - column) * sizeof(float));
+}
+
+// Shifts the bits right of column one place left, across words, leaving the
+// bits past the new width clear.
+void mask_remove_column_at_row(Mask mask, int row, int column) {
+  uint64_t *words = MASK_ROW(mask, row);
+  int last = (mask.width - 1) / 64;
+  int i = column / 64;
+  int bit = column % 64;
+  uint64_t below = words[i] & ((UINT64_C(1) << bit) - 1);
+  words[i] = below | (words[i] >> bit >> 1) << bit;
+  for (; i < last; i++) {
+    words[i] |= words[i + 1] << 63;
+    words[i + 1] >>= 1;
+  }
+}
+
+// Puts a column back at x, the inverse of img_remove_column_at_row. The
+// stride must leave room for the wider row.
+void img_insert_column_at_row(Image img, int y, int x, int stride,
+                              Color pixel) {
+  Color *pixel_row = &((Color *)img.data)[y * stride];
+  memmove(pixel_row + x + 1, pixel_row + x, (img.width - x) * sizeof(Color));
+  pixel_row[x] = pixel;
+}
+
+// Inverse of mat_remove_column_at_row, the right ghost column moving along
+void mat_insert_column_at_row(Mat mat, int row, int column, float value) {
+  float *pixel_row = &MAT_AT(mat, row, 0, mat.stride);
+  memmove(pixel_row + column + 1, pixel_row + column,
+          (mat.width - column + 1) * sizeof(float));
+  pixel_row[column] = value;
+}
+
+int mask_stride(int w) { return (w + 63) / 64; }
+
+size_t mask_bytes(int w, int h) {
+  return arena_bytes((size_t)h * mask_stride(w), sizeof(uint64_t));
+}
+
+Mask mask_alloc(Arena *arena, int w, int h) {
+  Mask mask = {0};
+  mask.width = w;
+  mask.height = h;
+  mask.stride = mask_stride(w);
+  mask.bits = arena_alloc(arena, (size_t)h * mask.stride, sizeof(uint64_t));
+  memset(mask.bits, 0, (size_t)h * mask.stride * sizeof(uint64_t));
+  return mask;
+}
+
+// Pixels brighter than mid grey are set
+Mask mask_from_image(Arena *arena, Image img, int stride) {
+  Mask mask = mask_alloc(arena, img.width, img.height);
+  for (int y = 0; y < img.height; y++) {
+    const Color *pixels = &((Color *)img.data)[y * stride];
+    uint64_t *words = MASK_ROW(mask, y);
+    for (int x = 0; x < img.width; x++) {
+      uint64_t set = rgb_to_luminance(pixels[x]) > 127.5f;
+      words[x / 64] |= set << (x % 64);
+    }
+  }
+  return mask;
+}
+
+long mask_count(Mask mask) {
+  long count = 0;
+  for (int y = 0; y < mask.height; y++) {
+    const uint64_t *words = MASK_ROW(mask, y);
+    for (int i = 0; i < mask_stride(mask.width); i++) {
+      count += __builtin_popcountll(words[i]);
+    }
+  }
+  return count;
+}
+
+size_t mat_bytes(int w, int h) {
+  return arena_bytes((size_t)(h + 2) * mat_stride(w), sizeof(float));
+}
+
+void mat_fill_ghost(Mat mat, float value) {
+  for (int x = -1; x <= mat.width; x++) {
+    MAT_AT(mat, -1, x, mat.stride) = value;
+    MAT_AT(mat, mat.height, x, mat.stride) = value;
+  }
+  for (int y = 0; y < mat.height; y++) {
+    MAT_AT(mat, y, -1, mat.stride) = value;
+    MAT_AT(mat, y, mat.width, mat.stride) = value;
+  }
+}
+
+Mat mat_alloc(Arena *arena, int w, int h, float ghost) {
+  Mat mat = {0};
+  mat.width = w;
+  mat.height = h;
+  mat.stride = mat_stride(w);
+  float *base = arena_alloc(arena, (size_t)(h + 2) * mat.stride,
+                            sizeof(*mat.data));
+  mat.data = base + mat.stride + MAT_ALIGN;
+  mat_fill_ghost(mat, ghost);
+  return mat;
+}
+
+// Transposes src into dst, ghost border included. dst must have room for it;
+// it is returned resized to match.
+Mat mat_transpose(Mat dst, Mat src) {
+  dst.width = src.height;
+  dst.height = src.width;
+  assert(dst.width + 1 + MAT_ALIGN <= dst.stride);
+
+  for (int y0 = -1; y0 <= src.height; y0 += TRANSPOSE_BLOCK) {
+    int y1 = y0 + TRANSPOSE_BLOCK;
+    y1 = y1 < src.height + 1 ? y1 : src.height + 1;
+    for (int x0 = -1; x0 <= src.width; x0 += TRANSPOSE_BLOCK) {
+      int x1 = x0 + TRANSPOSE_BLOCK;
+      x1 = x1 < src.width + 1 ? x1 : src.width + 1;
+      for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+          MAT_AT(dst, x, y, dst.stride) = MAT_AT(src, y, x, src.stride);
+        }
+      }
+    }
+  }
+
+  return dst;
+}
+
+// Copies src into dst, ghost border included. dst must have been allocated
+// with the same size; it is returned resized to match.
+Mat mat_copy(Mat dst, Mat src) {
+  assert(dst.stride == src.stride && dst.height == src.height);
+  memcpy(dst.data - dst.stride - MAT_ALIGN, src.data - src.stride - MAT_ALIGN,
+         (size_t)(src.height + 2) * src.stride * sizeof(float));
+  dst.width = src.width;
+  return dst;
+}
+
+Mat image_luminance(Arena *arena, Image img, int stride) {
+  Mat mat = mat_alloc(arena, img.width, img.height, 0.0f);
+  for (int y = 0; y < img.height; y++) {
+    luminance_row(&((Color *)img.data)[y * stride], MAT_ROW(mat, y),
+                  img.width);
+  }
+
+  return mat;
+}
+
+// Pixel rows padded to whole cache lines
+int img_stride_for(int w) {
+  int per_line = 64 / sizeof(Color);
+  return (w + per_line - 1) / per_line * per_line;
+}
+
+Image img_new(Arena *arena, int w, int h, int stride) {
+  Image img = {0};
+  img.width = w;
+  img.height = h;
+  img.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+  img.mipmaps = 1;
+  img.data = arena_alloc(arena, (size_t)stride * h, sizeof(Color));
+  return img;
+}
+
+// Writes the transpose of src into dst, which must be large enough, and
+// returns dst resized to match.
+Image img_transpose(Image dst, int dst_stride, Image src, int src_stride) {
+  dst.width = src.height;
+  dst.height = src.width;
+
+  Color *dst_data = dst.data;
+  const Color *src_data = src.data;
+  for (int y0 = 0; y0 < src.height; y0 += TRANSPOSE_BLOCK) {
+    int y1 = y0 + TRANSPOSE_BLOCK;
+    y1 = y1 < src.height ? y1 : src.height;
+    for (int x0 = 0; x0 < src.width; x0 += TRANSPOSE_BLOCK) {
+      int x1 = x0 + TRANSPOSE_BLOCK;
+      x1 = x1 < src.width ? x1 : src.width;
+      for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+          dst_data[x * dst_stride + y] = src_data[y * src_stride + x];
+        }
+      }
+    }
+  }
+
+  return dst;
+}
+
+// Copies the visible part of a strided image into dst, which must be at least
+// as large, and returns dst resized to match.
+Image img_copy(Image dst, int dst_stride, Image src, int src_stride) {
+  dst.width = src.width;
+  dst.height = src.height;
+
+  Color *dst_data = dst.data;
+  Color *src_data = src.data;
+  for (int y = 0; y < dst.height; y++) {
+    memcpy(&dst_data[y * dst_stride], &src_data[y * src_stride],
+           dst.width * sizeof(Color));
+  }
+
+  return dst;
+}
@@ -0,0 +1,123 @@
+#ifndef CARVE_H
+#define CARVE_H
+
+#include <raylib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define MAT_WITHIN(mat, row, col)                                              \
+  (0 <= (col) && (col) < (mat).width && 0 <= (row) && (row) < (mat).height)
+#define MAT_AT(mat, row, col, stride) (mat).data[(row) * stride + (col)]
+#define MAT_ROW(mat, row)                                                      \
+  ((float *)__builtin_assume_aligned(&MAT_AT(mat, row, 0, (mat).stride), 64))
+
+// Largest Sobel response on luminance: 4 * 255 on both axes
+#define SOBEL_MAX 1443.0f
+
+// Floats per 64-byte cache line. Every row starts on a cache line and the
+// stride is a whole number of them.
+#define MAT_ALIGN 16
+
+/*
+A Mat is surrounded by a ghost border one pixel wide: a row above and below
+the image and a column on each side. The border holds what a kernel should
+see outside the image (zero for Sobel, FLT_MAX for the DP), so kernels never
+check bounds. data points at row 0, column 0, which is cache line aligned;
+the left ghost column sits at the end of the padding before it.
+*/
+typedef struct {
+  float *data;
+  int width;
+  int height;
+  int stride;
+} Mat;
+
+int mat_stride(int w);
+size_t mat_bytes(int w, int h);
+Mat mat_alloc(Arena *arena, int w, int h, float ghost);
+void mat_fill_ghost(Mat mat, float value);
+Mat mat_copy(Mat dst, Mat src);
+Mat mat_transpose(Mat dst, Mat src);
+void mat_remove_column_at_row(Mat mat, int row, int column);
+void mat_insert_column_at_row(Mat mat, int row, int column, float value);
+
+/*
+One bit per pixel, bit x % 64 of word x / 64 of its row, for pixels to be
+protected or removed. Rows are a whole number of words and have no border;
+bits past the width are always clear.
+*/
+typedef struct {
+  uint64_t *bits;
+  int width;
+  int height;
+  int stride;
+} Mask;
+
+#define MASK_ROW(mask, row) (&(mask).bits[(size_t)(row) * (mask).stride])
+#define MASK_AT(mask, row, col)                                                \
+  (MASK_ROW(mask, row)[(col) / 64] >> ((col) % 64) & 1)
+
+int mask_stride(int w);
+size_t mask_bytes(int w, int h);
+Mask mask_alloc(Arena *arena, int w, int h);
+Mask mask_from_image(Arena *arena, Image img, int stride);
+long mask_count(Mask mask);
+void mask_remove_column_at_row(Mask mask, int row, int column);
+
+int img_stride_for(int w);
+Image img_new(Arena *arena, int w, int h, int stride);
+Image img_copy(Image dst, int dst_stride, Image src, int src_stride);
+Image img_transpose(Image dst, int dst_stride, Image src, int src_stride);
+void img_remove_column_at_row(Image img, int y, int x, int stride);
+void img_insert_column_at_row(Image img, int y, int x, int stride,
+                              Color pixel);
+
+// Row kernels. Rows passed in must have valid ghost columns at -1 and width.
+void luminance_row(const Color *pixels, float *out, int width);
+void sobel_row(const float *above, const float *row, const float *below,
+               float *out, int width);
+void sobel_row_masked(const float *above, const float *row, const float *below,
+                      const uint64_t *protect, const uint64_t *remove,
+                      float excluded, float bonus, float *out, int width);
+void dp_row(const float *prev, const float *energy, float *out, int width);
+void dp_row_trace(const float *prev, const float *energy, float *out,
+                  int8_t *trace, int width);
+
+/*
+Scratch of beam_seam for images up to width columns and height rows: the
+column of every path kept and the path it grew from, row by row, the cost of
+the paths of the last two rows, the slice of every column, and the columns a
+row's paths grow into.
+*/
+typedef struct {
+  int beam;
+  int *columns;
+  int *parents;
+  float *cost;
+  float *next_cost;
+  int *slice_of;
+  int *grown;
+  int *grown_parents;
+  float *grown_cost;
+} Beam;
+
+size_t beam_bytes(int w, int h, int beam);
+Beam beam_new(Arena *arena, int w, int h, int beam);
+void beam_seam(Beam *beam, Mat gradient, int *seam);
+
+Mat image_luminance(Arena *arena, Image img, int stride);
+void sobel_filter(Mat img, Mat gradient);
+void sobel_filter_masked(Mat img, Mat gradient, Mask protect, Mask remove,
+                         float bonus);
+void gradient_to_dp(Mat gradient, Mat dp);
+void dp_after_seam(Mat gradient, Mat dp, const int *seam);
+void compute_seam(Mat dp, int *seam);
+float seam_energy(Mat gradient, const int *seam);
+void band_seam(Mat gradient, const int *guide, int radius, float coherence,
+               float *cost, int8_t *trace, int *seam);
+void guided_seam(Mat gradient, const int *guide, int radius, Mat dp,
+                 int *seam);
+
+#endif // CARVE_H
@@ -0,0 +1,193 @@
+#include "libseam.h"
+
+#include <float.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "carve.h"
+#include "trace.h"
+
+struct SeamCtx {
+  SeamAllocator allocator;
+  // Without an allocator the arena is mapped by arena_new, with one it sits
+  // in block
+  bool mapped;
+  Arena arena;
+  void *block;
+  size_t block_size;
+  // Width of the beam search for seams, the exact DP when zero
+  int beam;
+};
+
+static void *system_alloc(size_t size, void *user) {
+  (void)user;
+  return malloc(size);
+}
+
+static void system_free(void *ptr, size_t size, void *user) {
+  (void)size;
+  (void)user;
+  free(ptr);
+}
+
+SeamCtx *seam_ctx_create(const SeamAllocator *allocator) {
+  SeamAllocator system = {.alloc = system_alloc, .free = system_free};
+  const SeamAllocator *a = allocator != NULL ? allocator : &system;
+  SeamCtx *ctx = a->alloc(sizeof(SeamCtx), a->user);
+  if (ctx != NULL) {
+    *ctx = (SeamCtx){.allocator = *a, .mapped = allocator == NULL};
+  }
+  return ctx;
+}
+
+static void ctx_release(SeamCtx *ctx) {
+  if (ctx->mapped && ctx->arena.base != NULL) {
+    arena_destroy(&ctx->arena);
+  } else if (ctx->block != NULL) {
+    ctx->allocator.free(ctx->block, ctx->block_size, ctx->allocator.user);
+  }
+  ctx->arena = (Arena){0};
+  ctx->block = NULL;
+  ctx->block_size = 0;
+}
+
+void seam_ctx_trim(SeamCtx *ctx, size_t keep) {
+  if (ctx->arena.size > keep) {
+    ctx_release(ctx);
+  }
+}
+
+void seam_ctx_destroy(SeamCtx *ctx) {
+  if (ctx != NULL) {
+    ctx_release(ctx);
+    ctx->allocator.free(ctx, sizeof(SeamCtx), ctx->allocator.user);
+  }
+}
+
+// Rewinds the working memory, after growing it if it is smaller than bytes
+static bool ctx_reserve(SeamCtx *ctx, size_t bytes) {
+  if (ctx->arena.size < bytes) {
+    size_t size = bytes + bytes / 4;
+    if (ctx->mapped) {
+      ctx_release(ctx);
+      if (!arena_try_new(size, &ctx->arena)) {
+        return false;
+      }
+    } else {
+      // Room to align the start of the block
+      void *block = ctx->allocator.alloc(size + ARENA_ALIGN,
+                                         ctx->allocator.user);
+      if (block == NULL) {
+        return false;
+      }
+      ctx_release(ctx);
+      ctx->block = block;
+      ctx->block_size = size + ARENA_ALIGN;
+      ctx->arena = arena_on(block, ctx->block_size);
+    }
+  }
+  arena_reset(&ctx->arena);
+  return true;
+}
+
+void seam_ctx_set_beam(SeamCtx *ctx, int beam) {
+  ctx->beam = beam > 0 ? beam : 0;
+}
+
+// The beam search needs no DP
+static size_t columns_bytes(int w, int h, int beam) {
+  return 2 * mat_bytes(w, h) + arena_bytes(h, sizeof(int)) +
+         (beam > 0 ? beam_bytes(w, h, beam) : mat_bytes(w, h));
+}
+
+static Image carve_columns(Arena *arena, Image img, int stride, int target,
+                           int beam) {
+  int w = img.width;
+  int h = img.height;
+  Mat gradient = mat_alloc(arena, w, h, 0.0f);
+  Mat dp = {0};
+  Beam search = {0};
+  if (beam > 0) {
+    search = beam_new(arena, w, h, beam);
+  } else {
+    dp = mat_alloc(arena, w, h, FLT_MAX);
+  }
+  int *seam = arena_alloc(arena, h, sizeof(int));
+  {
+    TRACE_SCOPE("sobel_filter");
+    Mat luminance = image_luminance(arena, img, stride);
+    sobel_filter(luminance, gradient);
+  }
+
+  for (; img.width > target; img.width--) {
+    if (beam > 0) {
+      TRACE_SCOPE("beam_seam");
+      beam_seam(&search, gradient, seam);
+    } else {
+      {
+        TRACE_SCOPE("gradient_to_dp");
+        gradient_to_dp(gradient, dp);
+      }
+      TRACE_SCOPE("compute_seam");
+      compute_seam(dp, seam);
+    }
+    TRACE_SCOPE("remove_seam");
+    for (int y = 0; y < h; y++) {
+      img_remove_column_at_row(img, y, seam[y], stride);
+      mat_remove_column_at_row(gradient, y, seam[y]);
+    }
+    gradient.width--;
+    dp.width--;
+  }
+  return img;
+}
+
+// Rows are carved as the columns of a transposed copy, as in the viewer
+SeamStatus seam_ctx_carve(SeamCtx *ctx, SeamImage *image, int target_width,
+                          int target_height) {
+  int width = image->width;
+  int height = image->height;
+  int stride = image->stride;
+  if (image->pixels == NULL || width <= 0 || height <= 0 || stride < width) {
+    return SEAM_BAD_IMAGE;
+  }
+
+  int tw = target_width > 0 ? target_width : width;
+  int th = target_height > 0 ? target_height : height;
+  if (target_width < 0 || target_height < 0 || tw > width || th > height) {
+    return SEAM_BAD_TARGET;
+  }
+
+  size_t bytes = columns_bytes(width, height, ctx->beam);
+  if (th < height) {
+    size_t rows = arena_bytes((size_t)tw * height, sizeof(Color)) +
+                  columns_bytes(height, tw, ctx->beam);
+    bytes = rows > bytes ? rows : bytes;
+  }
+  if (!ctx_reserve(ctx, bytes)) {
+    return SEAM_NO_MEMORY;
+  }
+
+  Image img = {
+      .data = image->pixels,
+      .width = width,
+      .height = height,
+      .mipmaps = 1,
+      .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+  };
+  img = carve_columns(&ctx->arena, img, stride, tw, ctx->beam);
+
+  if (th < height) {
+    arena_reset(&ctx->arena);
+    Image t = img;
+    t.data = arena_alloc(&ctx->arena, (size_t)tw * height, sizeof(Color));
+    t = img_transpose(t, height, img, stride);
+    t = carve_columns(&ctx->arena, t, height, th, ctx->beam);
+    img_transpose(img, stride, t, height);
+  }
+
+  image->width = tw;
+  image->height = th;
+  return SEAM_OK;
+}
@@ -1,4 +1,5 @@
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 #include <raylib.h>
 #include <stdbool.h>
@@ -7,402 +8,1143 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #define RAYGUI_IMPLEMENTATION
 #include "raygui.h"
 #include <assert.h>
 
+#include "arena.h"
+#include "batch.h"
+#include "carve.h"
+#include "perf.h"
+#include "rawio.h"
+#include "removal.h"
+#include "seamlog.h"
+#include "server.h"
+#include "snapshot.h"
+#include "tiled.h"
+#include "trace.h"
+#include "video.h"
+
 #define WIDTH 1920
 #define HEIGHT 1080
 
-#define MAT_WITHIN(mat, row, col)                                              \
-  (0 <= (col) && (col) < (mat).width && 0 <= (row) && (row) < (mat).height)
-#define MAT_AT(mat, row, col, stride) (mat).data[(row) * stride + (col)]
+/*
+A diagnostic rendering of a Mat kept on the GPU. The image is rebuilt with
+mat_to_img whenever the Mat it shows changes, which marks the view dirty;
+the texture is refreshed from it on the next draw and is otherwise reused.
+*/
+typedef struct {
+  Image img;
+  Texture tex;
+  bool dirty;
+} View;
+
+static void view_load(View *view) {
+  view->tex = LoadTextureFromImage(view->img);
+  view->dirty = false;
+}
 
-static float sobel_x[3][3] = {
-    {-1, 0, 1},
-    {-2, 0, 2},
-    {-1, 0, 1},
-};
+static void view_draw(View *view) {
+  if (view->dirty) {
+    UpdateTexture(view->tex, view->img.data);
+    view->dirty = false;
+  }
+  DrawTexture(view->tex, WIDTH / 2 - view->img.width / 2,
+              HEIGHT / 2 - view->img.height / 2, WHITE);
+}
+
+static void seam_span(const int *seam, int height, int *x0, int *x1) {
+  *x0 = seam[0];
+  *x1 = seam[0] + 1;
+  for (int y = 1; y < height; y++) {
+    if (seam[y] < *x0) {
+      *x0 = seam[y];
+    }
+    if (seam[y] + 1 > *x1) {
+      *x1 = seam[y] + 1;
+    }
+  }
+}
+
+/*
+Uploads the columns [x0, x1) of every row to a texture as wide as the
+stride. A full-width span is contiguous in the strided buffer and is sent as
+is; a narrower one is packed into scratch first, copying only what changed.
+*/
+static void texture_update_columns(Texture tex, Image img, int stride, int x0,
+                                   int x1, Color *scratch) {
+  if (x0 >= x1) {
+    return;
+  }
+
+  Rectangle rec = {x0, 0, x1 - x0, img.height};
+  Color *data = img.data;
+  if (x0 == 0 && x1 == stride) {
+    UpdateTextureRec(tex, rec, data);
+    return;
+  }
+
+  int w = x1 - x0;
+  for (int y = 0; y < img.height; y++) {
+    memcpy(&scratch[y * w], &data[y * stride + x0], w * sizeof(Color));
+  }
+  UpdateTextureRec(tex, rec, scratch);
+}
+
+static void mat_to_img(Mat mat, Image img) {
+  assert(img.width == mat.width);
+  assert(img.height == mat.height);
+
+  Color *data = img.data;
+  for (int y = 0; y < mat.height; y++) {
+    for (int x = 0; x < mat.width; x++) {
+      uint8_t alpha = MAT_AT(mat, y, x, mat.stride);
+      data[y * mat.width + x] = (Color){255, 255, 255, alpha};
+    }
+  }
+}
+
+typedef enum {
+  STATE_START,
+  STATE_LUMINANCE,
+  STATE_GRADIENT,
+  STATE_SEAM_REMOVAL,
+} State;
+
+static State state = STATE_START;
+
+Image img;
+int img_stride;
+char *filepath;
+char *output_path;
+char *protect_path;
+int raw_width;
+int raw_height;
+RawImage raw;
+int seams_removed;
+Mat luminance;
+Mat gradient;
+Mat dp;
+
+View luminance_view;
+View gradient_view;
+
+// Every buffer lives in a single arena sized from the input image and
+// allocated once. The original image and its luminance and gradient are kept
+// aside so that a reset only has to copy them back.
+Arena arena;
+Image original;
+Mat original_luminance;
+Mat original_gradient;
+Image staging;
+Snapshot snapshots[3];
+int *seam;
+SeamLog seam_log;
+
+// Smallest size the image can be carved down to. The arena is sized for it,
+// and the viewer can aim anywhere between it and the original size.
+int min_width;
+int min_height;
 
-static float sobel_y[3][3] = {
-    {-1, -2, -1},
-    {0, 0, 0},
-    {1, 2, 1},
+/*
+With SEAM_PERF set, hardware counters are summed per stage: the energy pass
+and the uploads on the render thread, the seams on the worker. Reported at
+exit, once the worker has stopped.
+*/
+typedef enum {
+  STAGE_ENERGY,
+  STAGE_DP,
+  STAGE_BACKTRACK,
+  STAGE_REMOVAL,
+  STAGE_UPLOAD,
+  STAGES,
+} Stage;
+
+static const char *stage_names[STAGES] = {
+    "energy", "dp", "backtrack", "removal", "upload",
 };
 
+PerfGroup render_perf;
+PerfTotals stage_perf[STAGES];
+
+/*
+Rows are removed by carving the columns of the transposed image, which has a
+set of buffers of its own. While transposed is set, img, img_stride, the Mats
+and seam_log describe the transposed image and spare the upright one; the
+other way round, spare holds the transposed buffers and the log of rows.
+Whichever image spare holds is stale.
+*/
 typedef struct {
-  float *data;
-  int width;
-  int height;
+  Image img;
   int stride;
-} Mat;
-
-static float sobel_filter_at(Mat img, int cx, int cy) {
-  float sx = 0.0f;
-  float sy = 0.0f;
-
-  for (int dy = -1; dy <= 1; dy++) {
-    for (int dx = -1; dx <= 1; dx++) {
-      int x = cx + dx;
-      int y = cy + dy;
-      float c = MAT_WITHIN(img, y, x) ? MAT_AT(img, y, x, img.stride) : 0.0;
-      sx += c * sobel_x[dy + 1][dx + 1];
-      sy += c * sobel_y[dy + 1][dx + 1];
-    }
+  Mat luminance;
+  Mat gradient;
+  Mat dp;
+  SeamLog log;
+} WorkingSet;
+
+WorkingSet spare;
+bool transposed;
+
+static size_t state_arena_size(int w, int h, int min_w, int min_h) {
+  size_t pixels = (size_t)w * h;
+  // luminance_view, gradient_view, staging, original, img and three snapshots
+  size_t strided = arena_bytes((size_t)img_stride_for(w) * h, sizeof(Color));
+  size_t images = 4 * arena_bytes(pixels, sizeof(Color)) + 4 * strided;
+  // luminance, gradient and dp, and the original luminance and gradient
+  size_t mats = 5 * mat_bytes(w, h);
+  size_t logs = seam_log_bytes(h, w - min_w) + seam_log_bytes(w, h - min_h);
+  size_t seams = arena_bytes(w > h ? w : h, sizeof(int));
+  // The protect mask and an empty remove mask, only needed for the energy
+  size_t masks = protect_path != NULL ? 2 * mask_bytes(w, h) : 0;
+  if (min_h < h) {
+    // The transposed img and Mats
+    images += arena_bytes((size_t)img_stride_for(h) * w, sizeof(Color));
+    mats += 3 * mat_bytes(h, w);
   }
+  return images + mats + logs + seams + masks;
+}
 
-  return sqrtf(sx * sx + sy * sy);
+static Image load_image() {
+  Image loaded = LoadImage(filepath);
+  if (loaded.data == NULL) {
+    fprintf(stderr, "Could not load %s\n", filepath);
+    exit(1);
+  }
+  ImageFormat(&loaded, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  return loaded;
 }
 
-static void sobel_filter(Mat img, Mat gradient) {
-  assert(img.width == gradient.width);
-  assert(img.height == gradient.height);
+static void swap_state() {
+  WorkingSet cur = {img, img_stride, luminance, gradient, dp, seam_log};
+  img = spare.img;
+  img_stride = spare.stride;
+  luminance = spare.luminance;
+  gradient = spare.gradient;
+  dp = spare.dp;
+  seam_log = spare.log;
+  spare = cur;
+  transposed = !transposed;
+}
 
-  for (int cy = 0; cy < img.height; cy++) {
-    for (int cx = 0; cx < img.width; cx++) {
-      MAT_AT(gradient, cy, cx, img.stride) = sobel_filter_at(img, cx, cy);
-    }
+// Moves the working state over to the other orientation. The log of rows
+// starts afresh unless the columns are the same as when it was left.
+static void transpose_state() {
+  spare.img = img_transpose(spare.img, spare.stride, img, img_stride);
+  spare.luminance = mat_transpose(spare.luminance, luminance);
+  spare.gradient = mat_transpose(spare.gradient, gradient);
+  spare.dp.width = spare.gradient.width;
+  spare.dp.height = spare.gradient.height;
+  if (!transposed && spare.log.count == 0) {
+    seam_log_clear(&spare.log, img.width);
   }
+  swap_state();
 }
 
-// Human perception of brightness according to ITU-R BT.709
-static float rgb_to_luminance(Color c) {
-  return 0.299 * c.r + 0.587 * c.g + 0.114 * c.b;
+// Size of the image being carved, the right way up
+static int carved_width() { return transposed ? img.height : img.width; }
+static int carved_height() { return transposed ? img.width : img.height; }
+
+void reset_state() {
+  if (transposed) {
+    swap_state();
+  }
+  seams_removed = 0;
+  if (raw.in_place) {
+    // The private mapping drops its copies and reads the file again
+    img = raw_image_pixels(&raw, NULL);
+  } else {
+    img = img_copy(img, img_stride, original, original.width);
+  }
+  luminance = mat_copy(luminance, original_luminance);
+  gradient = mat_copy(gradient, original_gradient);
+  dp.width = img.width;
+  seam_log_clear(&seam_log, img.height);
+  seam_log_clear(&spare.log, img.width);
 }
 
-/*
+void set_state() {
+  Image loaded = {0};
 
-The optimal seam can be found using dynamic programming. The
-first step is to traverse the image from the second row to the last row
-and compute the cumulative minimum energy M for all possible
-connected seams for each entry (i, j):
+  // Uncompressed inputs are mapped rather than decoded
+  if (raw_image_open(filepath, raw_width, raw_height, &raw)) {
+    loaded.width = raw.width;
+    loaded.height = raw.height;
+  } else {
+    loaded = load_image();
+  }
+  int w = loaded.width;
+  int h = loaded.height;
 
-M(i, j) = e(i, j)+ min(M(i−1, j −1),M(i−1, j),M(i−1, j +1))
+  // Without a target the width is halved
+  min_width = min_width > 0 ? min_width : w / 2;
+  min_height = min_height > 0 ? min_height : h;
+  if (min_width < 1 || min_width > w || min_height > h) {
+    fprintf(stderr, "Target size must be between 1x1 and %dx%d\n", w, h);
+    exit(1);
+  }
 
- */
+  arena = arena_new(state_arena_size(w, h, min_width, min_height));
+  luminance_view.img = img_new(&arena, w, h, w);
+  gradient_view.img = img_new(&arena, w, h, w);
+  staging = img_new(&arena, w, h, w);
+  seam = arena_alloc(&arena, w > h ? w : h, sizeof(*seam));
+  seam_log = seam_log_new(&arena, h, w - min_width);
+  spare.log = seam_log_new(&arena, w, h - min_height);
+  if (min_height < h) {
+    spare.stride = img_stride_for(h);
+    spare.img = img_new(&arena, h, w, spare.stride);
+    spare.luminance = mat_alloc(&arena, h, w, 0.0f);
+    spare.gradient = mat_alloc(&arena, h, w, 0.0f);
+    spare.dp = mat_alloc(&arena, h, w, FLT_MAX);
+  }
 
-static void gradient_to_dp(Mat gradient, Mat dp) {
-  assert(dp.width == gradient.width);
-  assert(dp.height == gradient.height);
+  // A mapping edited in place is laid out by the file
+  img_stride = raw.in_place ? w : img_stride_for(w);
+  for (int i = 0; i < 3; i++) {
+    snapshots[i].img = img_new(&arena, w, h, img_stride);
+    snapshots[i].stride = img_stride;
+  }
 
-  for (int x = 0; x < gradient.width; x++) {
-    // First row is a given
-    MAT_AT(dp, 0, x, dp.stride) = MAT_AT(gradient, 0, x, gradient.stride);
+  if (raw.in_place) {
+    original = raw_image_pixels(&raw, NULL);
+  } else {
+    original = img_new(&arena, w, h, w);
+    if (raw.map != NULL) {
+      original = raw_image_pixels(&raw, original.data);
+    } else {
+      original = img_copy(original, w, loaded, w);
+      UnloadImage(loaded);
+    }
+    img = img_new(&arena, w, h, img_stride);
   }
 
-  for (int y = 1; y < gradient.height; y++) {
-    for (int cx = 0; cx < gradient.width; cx++) {
-      // Compute minimal value moving down left, down or down right
-      float m = FLT_MAX;
-      for (int dx = -1; dx <= 1; dx++) {
-        int x = cx + dx;
-        float c = (0 <= x && x < gradient.width)
-                      ? MAT_AT(dp, y - 1, x, dp.stride)
-                      : FLT_MAX;
-        if (c < m)
-          m = c;
-      }
-      MAT_AT(dp, y, cx, dp.stride) =
-          MAT_AT(gradient, y, cx, gradient.stride) + m;
+  Mask protect = {0};
+  if (protect_path != NULL) {
+    Image mask = LoadImage(protect_path);
+    if (mask.data == NULL || mask.width != w || mask.height != h) {
+      fprintf(stderr, "%s must be a %dx%d image\n", protect_path, w, h);
+      exit(1);
     }
+    ImageFormat(&mask, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    protect = mask_from_image(&arena, mask, w);
+    UnloadImage(mask);
+  }
+
+  TRACE_SCOPE("set_state");
+  perf_begin(&render_perf);
+  original_luminance = image_luminance(&arena, original, original.width);
+  original_gradient = mat_alloc(&arena, w, h, 0.0f);
+  // The weights of the mask are kept with the gradient, through removals and
+  // the seam log alike
+  if (protect_path != NULL) {
+    sobel_filter_masked(original_luminance, original_gradient, protect,
+                        mask_alloc(&arena, w, h), 0.0f);
+  } else {
+    sobel_filter(original_luminance, original_gradient);
   }
+  perf_end(&render_perf, &stage_perf[STAGE_ENERGY]);
+  luminance = mat_alloc(&arena, w, h, 0.0f);
+  gradient = mat_alloc(&arena, w, h, 0.0f);
+  dp = mat_alloc(&arena, w, h, FLT_MAX);
+
+  mat_to_img(original_luminance, luminance_view.img);
+  mat_to_img(original_gradient, gradient_view.img);
+  luminance_view.dirty = true;
+  gradient_view.dirty = true;
+
+  reset_state();
 }
 
 /*
-At the end of this process, the minimum value of the last row in
-M will indicate the end of the minimal connected vertical seam.
-Hence, in the second step we backtrack from this minimum entry on
-M to find the path of the optimal seam (see Figure 1). The definition
-of M for horizontal seams is similar
+Carving runs on a worker thread that owns img, the Mats and the seam once it
+has started; the render loop only ever sees snapshots of them. A seam is
+shown for rate frames' worth of time before it is removed, and a rate of
+zero carves as fast as the engine goes.
+
+In budget mode the worker instead spends up to budget seconds of every frame
+removing seams back to back, then shows the next one until the frame is over.
+
+The worker carves or puts seams back until the image is the target size:
+columns first, then rows. The DP and the seam are only rebuilt once shown is
+cleared by a removal or a reset. A worker with nothing left to do records in
+idle_at how many commands it had handled before it went to sleep, which tells
+the render loop that no snapshot will come before the next key press.
 */
+typedef struct {
+  pthread_t thread;
+  CommandQueue commands;
+  SnapshotBuffer snapshots;
 
-static void compute_seam2(Mat dp, int *seam) {
-  int y = dp.height - 1;
-  seam[y] = 0;
-  for (int x = 1; x < dp.width; ++x) {
-    if (MAT_AT(dp, y, x, dp.stride) < MAT_AT(dp, y, seam[y], dp.stride)) {
-      seam[y] = x;
-    }
+  bool carving;
+  bool paused;
+  bool shown;
+  bool budgeted;
+  int rate;
+  double budget;
+  int target_width;
+  int target_height;
+  atomic_int requested_width;
+  atomic_int requested_height;
+  double hold_until;
+  double published_at;
+  int dirty_x0;
+  int handled;
+  atomic_int idle_at;
+  PerfGroup perf;
+} Worker;
+
+Worker worker;
+
+#define PUBLISH_INTERVAL (1.0 / 120.0)
+#define FRAME_PERIOD (1.0 / 60.0)
+#define DEFAULT_BUDGET 0.008
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// In budget mode a seam is only shown until the current frame is over
+static double hold_seconds() {
+  return worker.budgeted ? 0 : worker.rate / 60.0;
+}
+
+static void mark_dirty(int x0) {
+  if (x0 < worker.dirty_x0) {
+    worker.dirty_x0 = x0;
+  }
+}
+
+// Copies the working image into the back snapshot, with the pending seam
+// painted on the copy, and hands it to the render loop. Unless forced,
+// snapshots are limited to a couple per display frame.
+static void worker_publish(bool force) {
+  double t = now();
+  if (worker.dirty_x0 == INT_MAX ||
+      (!force && t - worker.published_at < PUBLISH_INTERVAL)) {
+    return;
   }
 
-  for (y = dp.height - 2; y >= 0; --y) {
-    seam[y] = seam[y + 1];
-    for (int dx = -1; dx <= 1; ++dx) {
-      int x = seam[y + 1] + dx;
-      if (0 <= x && x < dp.width &&
-          MAT_AT(dp, y, x, dp.stride) < MAT_AT(dp, y, seam[y], dp.stride)) {
-        seam[y] = x;
+  Snapshot *snap = snapshot_back(&worker.snapshots);
+  if (transposed) {
+    snap->img = img_transpose(snap->img, snap->stride, img, img_stride);
+  } else {
+    snap->img = img_copy(snap->img, snap->stride, img, img_stride);
+  }
+  snap->x0 = worker.dirty_x0;
+  snap->seams_removed = seams_removed;
+  snap->target_width = worker.target_width;
+  snap->target_height = worker.target_height;
+  if (worker.shown) {
+    Color *data = snap->img.data;
+    for (int y = 0; y < img.height; y++) {
+      if (transposed) {
+        data[seam[y] * snap->stride + y] = RED;
+      } else {
+        data[y * snap->stride + seam[y]] = RED;
       }
     }
   }
-}
 
-static void compute_seam(Mat dp, int *seam) {
-  int y = dp.height - 1;
-  seam[y] = 0;
+  snapshot_publish(&worker.snapshots);
+  worker.dirty_x0 = INT_MAX;
+  worker.published_at = t;
+}
 
-  // Get minimum value at the last row
-  for (int x = 1; x < dp.width; x++) {
-    if (MAT_AT(dp, y, x, dp.stride) < MAT_AT(dp, y, seam[y], dp.stride)) {
-      seam[y] = x;
-    }
+// Everything right of the leftmost pixel of a seam moves when it is removed or
+// put back, and every column when the seam is a row.
+static void mark_seam_dirty() {
+  if (transposed) {
+    mark_dirty(0);
+    return;
   }
 
-  for (y = dp.height - 2; y >= 0; y--) {
-    seam[y] = seam[y + 1]; // previous value
-    for (int dx = -1; dx <= 1; dx++) {
-      int x = seam[y + 1] + dx;
-      if ((0 <= x && x < dp.width) &&
-          MAT_AT(dp, y, x, dp.stride) < MAT_AT(dp, y, seam[y], dp.stride)) {
-        seam[y] = x;
-      }
-    }
+  int x0, x1;
+  seam_span(seam, img.height, &x0, &x1);
+  mark_dirty(x0);
+}
+
+// Rows are carved once the width is right, and columns only with every row
+// put back
+static void worker_orient() {
+  if (transposed && seam_log.cursor == 0 &&
+      carved_width() != worker.target_width) {
+    transpose_state();
+    worker.shown = false;
+  } else if (!transposed && carved_width() == worker.target_width &&
+             carved_height() > worker.target_height) {
+    transpose_state();
+    worker.shown = false;
   }
 }
 
-static void img_remove_column_at_row(Image img, int y, int x, int stride) {
-  Color *data = img.data;
-  Color *pixel_row = &data[y * stride];
-  memmove(pixel_row + x, pixel_row + x + 1, (stride - x - 1) * sizeof(Color));
+// 1 while seams have to be removed to get to the target, -1 while some have
+// to be put back
+static int worker_direction() {
+  if (!worker.carving) {
+    return 0;
+  }
+  worker_orient();
+  if (carved_width() != worker.target_width) {
+    return transposed || carved_width() < worker.target_width ? -1 : 1;
+  }
+  int dh = carved_height() - worker.target_height;
+  return (dh > 0) - (dh < 0);
 }
 
-static void mat_remove_column_at_row(Mat mat, int row, int column) {
-  float *pixel_row = &MAT_AT(mat, row, 0, mat.stride);
-  memmove(pixel_row + column, pixel_row + column + 1,
-          (mat.stride - column - 1) * sizeof(float));
+static void worker_find_seam() {
+  {
+    TRACE_SCOPE("gradient_to_dp");
+    perf_begin(&worker.perf);
+    gradient_to_dp(gradient, dp);
+    perf_end(&worker.perf, &stage_perf[STAGE_DP]);
+  }
+  {
+    TRACE_SCOPE("compute_seam");
+    perf_begin(&worker.perf);
+    compute_seam(dp, seam);
+    perf_end(&worker.perf, &stage_perf[STAGE_BACKTRACK]);
+  }
+  worker.shown = true;
+  worker.hold_until = now() + hold_seconds();
+  mark_seam_dirty();
 }
 
-static Mat mat_alloc(int w, int h) {
-  Mat mat = {0};
-  mat.width = w;
-  mat.height = h;
-  mat.data = calloc(mat.width * mat.height, sizeof(*mat.data));
-  mat.stride = w;
-  assert(mat.data != NULL);
-  return mat;
+static void worker_remove_seam() {
+  TRACE_SCOPE("remove_seam");
+  perf_begin(&worker.perf);
+  seam_log_push(&seam_log, seam, img, img_stride, gradient);
+  if (!transposed) {
+    // Rows carved from other columns no longer apply
+    seam_log_clear(&spare.log, img.width - 1);
+  }
+  for (int cy = 0; cy < img.height; ++cy) {
+    int cx = seam[cy];
+    img_remove_column_at_row(img, cy, cx, img_stride);
+    mat_remove_column_at_row(luminance, cy, cx);
+    mat_remove_column_at_row(gradient, cy, cx);
+  }
+
+  img.width -= 1;
+  luminance.width -= 1;
+  gradient.width -= 1;
+  dp.width -= 1;
+  seams_removed += 1;
+  worker.shown = false;
+  perf_end(&worker.perf, &stage_perf[STAGE_REMOVAL]);
+  mark_seam_dirty();
 }
 
-static Mat image_luminance(Image img) {
-  Mat mat = mat_alloc(img.width, img.height);
-  for (int x = 0; x < img.width; x++) {
-    for (int y = 0; y < img.height; y++) {
-      Color c = ((Color *)img.data)[y * img.width + x];
-      MAT_AT(mat, y, x, mat.width) = rgb_to_luminance(c);
+static void worker_carve_for(double budget) {
+  double start = now();
+  do {
+    worker_remove_seam();
+    if (worker_direction() > 0) {
+      worker_find_seam();
     }
+  } while (worker.shown && now() - start < budget);
+
+  worker.hold_until = start + FRAME_PERIOD;
+  worker_publish(true);
+}
+
+static bool worker_undo() {
+  // The seam on show is painted in the last snapshot, and seam is about to
+  // be overwritten with the one brought back
+  if (worker.shown) {
+    mark_seam_dirty();
+  }
+  if (transposed && seam_log.cursor == 0) {
+    transpose_state();
+  }
+  if (!seam_log_undo(&seam_log, &img, img_stride, &luminance, &gradient,
+                     seam)) {
+    return false;
   }
 
-  return mat;
+  dp.width = img.width;
+  seams_removed -= 1;
+  worker.shown = false;
+  mark_seam_dirty();
+  return true;
 }
 
-#define ARENA_SIZE HEIGHT *WIDTH * sizeof(Color)
-static uint8_t arena[ARENA_SIZE] = {0};
+static bool worker_redo() {
+  // As in worker_undo, before seam is overwritten
+  if (worker.shown) {
+    mark_seam_dirty();
+  }
+  if (!transposed && seam_log.cursor == seam_log.count &&
+      spare.log.count > 0) {
+    transpose_state();
+  }
+  if (!seam_log_redo(&seam_log, &img, img_stride, &luminance, &gradient,
+                     seam)) {
+    return false;
+  }
 
-static inline void *arena_alloc(size_t nb, size_t size) {
-  assert(nb * size <= ARENA_SIZE);
-  return arena;
+  dp.width = img.width;
+  seams_removed += 1;
+  worker.shown = false;
+  mark_seam_dirty();
+  return true;
 }
 
-static inline void arena_free() { memset(arena, 0, ARENA_SIZE); }
+// Steps through the seam logs, the target following along so that the
+// carving stays where it was scrubbed to
+static void worker_scrub(bool undo) {
+  if (!worker.carving || !(undo ? worker_undo() : worker_redo())) {
+    return;
+  }
+  worker.target_width = carved_width();
+  worker.target_height = carved_height();
+}
 
-static Image img_alloc(Image original, int stride) {
-  Image mat = {0};
-  mat.width = original.width;
-  mat.height = original.height;
-  mat.format = original.format;
-  mat.mipmaps = original.mipmaps;
-  Color *new_data = arena_alloc(mat.width * mat.height, sizeof(Color));
-  mat.data = new_data;
+static void worker_retarget() {
+  int w = atomic_load(&worker.requested_width);
+  int h = atomic_load(&worker.requested_height);
+  worker.target_width = w < min_width        ? min_width
+                        : w > original.width ? original.width
+                                             : w;
+  worker.target_height = h < min_height         ? min_height
+                         : h > original.height ? original.height
+                                               : h;
+  worker.shown = false;
+  mark_dirty(0);
+}
 
-  Color *original_data = original.data;
-  for (int y = 0; y < mat.height; y++) {
-    for (int x = 0; x < mat.width; x++) {
-      new_data[y * mat.width + x] = original_data[y * stride + x];
-    }
+static void worker_save() {
+  if (output_path == NULL) {
+    return;
   }
 
-  return mat;
+  // The upright buffers are free while the rows are being carved
+  Image upright = img;
+  int stride = img_stride;
+  if (transposed) {
+    upright = img_transpose(spare.img, spare.stride, img, img_stride);
+    stride = spare.stride;
+  }
+  if (!raw_image_write(output_path, upright, stride)) {
+    fprintf(stderr, "Could not write %s\n", output_path);
+  }
 }
 
-static void draw_mat(Image mat) {
-  for (int y = 0; y < mat.height; y++) {
-    for (int x = 0; x < mat.width; x++) {
-      Color *data = mat.data;
-      Color c = data[y * mat.width + x];
-      DrawRectangle(WIDTH / 2 - mat.width / 2 + x,
-                    HEIGHT / 2 - mat.height / 2 + y, 1, 1, c);
+static bool worker_handle(Command command) {
+  worker.handled++;
+  switch (command) {
+  case CMD_RESET:
+  case CMD_CARVE:
+    reset_state();
+    worker.carving = command == CMD_CARVE;
+    worker.shown = false;
+    mark_dirty(0);
+    break;
+  case CMD_PAUSE:
+    worker.paused = !worker.paused;
+    worker.hold_until = now() + hold_seconds();
+    break;
+  case CMD_FASTER:
+    if (worker.budgeted) {
+      worker.budget = fmin(worker.budget * 2, FRAME_PERIOD);
+    } else {
+      worker.rate /= 2;
+    }
+    break;
+  case CMD_SLOWER:
+    if (worker.budgeted) {
+      worker.budget = fmax(worker.budget / 2, 0.00025);
+    } else if (worker.rate <= 1024) {
+      worker.rate = worker.rate > 0 ? worker.rate * 2 : 1;
     }
+    break;
+  case CMD_BUDGET:
+    worker.budgeted = !worker.budgeted;
+    break;
+  case CMD_UNDO:
+  case CMD_REDO:
+    worker_scrub(command == CMD_UNDO);
+    break;
+  case CMD_TARGET:
+    worker_retarget();
+    break;
+  case CMD_SAVE:
+    worker_save();
+    break;
+  case CMD_QUIT:
+    return false;
   }
+  return true;
 }
 
-static Image mat_to_img(Mat mat, int mipmaps) {
-  Image img = {0};
-  img.width = mat.width;
-  img.height = mat.height;
-  img.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
-  img.mipmaps = 1;
-  Color *data = calloc(mat.width * mat.height, sizeof(Color));
-  img.data = data;
-  int i = 0;
-  for (int y = 0; y < mat.height; y++) {
-    for (int x = 0; x < mat.width; x++) {
-      uint8_t alpha = MAT_AT(mat, y, x, mat.stride);
-      data[y * mat.width + x] = (Color){255, 255, 255, alpha};
+static void *worker_run(void *arg) {
+  (void)arg;
+  trace_thread_name("carver");
+  perf_group_open(&worker.perf);
+  for (;;) {
+    Command command;
+    while (command_pop(&worker.commands, &command, 0)) {
+      if (!worker_handle(command)) {
+        return NULL;
+      }
     }
-  }
 
-  return img;
-}
+    int direction = worker_direction();
+    bool active = direction != 0;
+    if (direction > 0 && !worker.shown) {
+      worker_find_seam();
+      worker_publish(false);
+      continue;
+    }
+    if (direction < 0 && !worker.paused) {
+      // Seams come back straight from the log, without being shown
+      if (!worker_undo()) {
+        worker.target_width = carved_width();
+        worker.target_height = carved_height();
+      }
+      worker_publish(false);
+      continue;
+    }
+    if (active && !worker.paused && now() >= worker.hold_until) {
+      if (worker.budgeted) {
+        worker_carve_for(worker.budget);
+      } else {
+        worker_remove_seam();
+      }
+      continue;
+    }
 
-typedef enum {
-  STATE_START,
-  STATE_LUMINANCE,
-  STATE_GRADIENT,
-  STATE_SEAM_REMOVAL,
-} State;
+    // Nothing to do until a command arrives or the seam on screen has been
+    // shown long enough, so the latest state has to be out first.
+    worker_publish(true);
+    double timeout = -1;
+    if (active && !worker.paused) {
+      timeout = worker.hold_until - now();
+      timeout = timeout > 0 ? timeout : 0;
+    } else {
+      atomic_store(&worker.idle_at, worker.handled);
+    }
+    if (command_pop(&worker.commands, &command, timeout) &&
+        !worker_handle(command)) {
+      return NULL;
+    }
+  }
+}
 
-static State state = STATE_START;
+static void worker_start(double budget) {
+  snapshot_buffer_init(&worker.snapshots, snapshots);
+  command_queue_init(&worker.commands);
 
-Image img;
-char *filepath;
-int seams_removed;
-Mat luminance;
-Mat gradient;
-Mat dp;
+  worker.paused = true;
+  worker.rate = 128;
+  worker.budgeted = budget > 0;
+  worker.budget = budget > 0 ? budget : DEFAULT_BUDGET;
+  worker.target_width = min_width;
+  worker.target_height = min_height;
+  worker.dirty_x0 = INT_MAX;
+  atomic_init(&worker.idle_at, -1);
+  pthread_create(&worker.thread, NULL, worker_run, NULL);
+}
 
-bool init = false;
-Image initial_luminance;
-Image initial_gradient;
+static void worker_stop() {
+  while (!command_push(&worker.commands, CMD_QUIT)) {
+    sched_yield();
+  }
+  pthread_join(worker.thread, NULL);
+  command_queue_destroy(&worker.commands);
+  perf_group_close(&worker.perf);
+}
 
-void set_state() {
-  seams_removed = 0;
-  img = LoadImage(filepath);
-  ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+static void perf_report() {
+  for (int s = 0; s < STAGES; s++) {
+    const PerfTotals *t = &stage_perf[s];
+    if (t->runs > 0) {
+      char summary[128];
+      perf_format(t, summary, sizeof(summary));
+      fprintf(stderr, "%-9s %s over %ld runs", stage_names[s], summary,
+              t->runs);
+      if (t->counted[PERF_INSTRUCTIONS]) {
+        fprintf(stderr, ", %.0f instructions each",
+                t->counts[PERF_INSTRUCTIONS] / t->runs);
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+}
 
-  luminance = image_luminance(img);
-  gradient = mat_alloc(img.width, img.height);
-  sobel_filter(luminance, gradient);
+static int commands_sent;
 
-  if (!init) {
-    initial_luminance = mat_to_img(luminance, img.mipmaps);
-    initial_gradient = mat_to_img(gradient, img.mipmaps);
-    init = true;
+static void send_command(Command command) {
+  if (command_push(&worker.commands, command)) {
+    commands_sent++;
   }
+}
 
-  dp = mat_alloc(img.width, img.height);
+static void send_target(int width, int height) {
+  atomic_store(&worker.requested_width, width);
+  atomic_store(&worker.requested_height, height);
+  send_command(CMD_TARGET);
 }
 
-void reset_state() {
-  UnloadImage(img);
-  free(dp.data);
-  free(luminance.data);
-  free(gradient.data);
+static void handle_keys() {
+  if (IsKeyPressed(KEY_ONE)) {
+    send_command(CMD_RESET);
+    state = STATE_START;
+  } else if (IsKeyPressed(KEY_TWO)) {
+    state = STATE_LUMINANCE;
+  } else if (IsKeyPressed(KEY_THREE)) {
+    state = STATE_GRADIENT;
+  } else if (IsKeyPressed(KEY_FOUR)) {
+    send_command(CMD_CARVE);
+    state = STATE_SEAM_REMOVAL;
+  } else if (IsKeyPressed(KEY_UP)) {
+    send_command(CMD_FASTER);
+  } else if (IsKeyPressed(KEY_DOWN)) {
+    send_command(CMD_SLOWER);
+  } else if (IsKeyPressed(KEY_SPACE)) {
+    send_command(CMD_PAUSE);
+  } else if (IsKeyPressed(KEY_S)) {
+    send_command(CMD_SAVE);
+  } else if (IsKeyPressed(KEY_B)) {
+    send_command(CMD_BUDGET);
+  } else if (IsKeyPressed(KEY_LEFT) || IsKeyPressedRepeat(KEY_LEFT)) {
+    send_command(CMD_UNDO);
+  } else if (IsKeyPressed(KEY_RIGHT) || IsKeyPressedRepeat(KEY_RIGHT)) {
+    send_command(CMD_REDO);
+  }
+}
 
-  set_state();
+static void usage(const char *program) {
+  printf("Usage: %s [-s WIDTHxHEIGHT] [-o output] [-b ms] [-W width] "
+         "[-H height] [-P mask] [-T [-m MiB]] <image>\n"
+         "       %s -R mask [-P mask] -o output <image>\n"
+         "       %s -V -W width < input.y4m > output.y4m\n"
+         "       %s -B -o dir [-j threads] [-W width|percent] [-p factor] "
+         "[-S strips]\n          [-X budget[:cost]] <dir|manifest>\n"
+         "       %s -D socket [-j threads] [-q depth] [-m MiB]\n",
+         program, program, program, program, program);
+  printf("  -s  size of a headerless .rgba input\n");
+  printf("  -o  output of the -T and -R modes, directory of the -B mode, or in "
+         "the\n      viewer the file written when S is pressed (.pam, .ppm or "
+         ".rgba)\n");
+  printf("  -T  carve out of core, without a window, streaming from disk\n");
+  printf("  -W  target width, half the image width by default\n");
+  printf("  -H  target height, the image height by default. The viewer can\n"
+         "      aim anywhere between the target and the original size.\n");
+  printf("  -P  image of the same size, set where brighter than mid grey, of\n"
+         "      pixels seams stay clear of\n");
+  printf("  -R  carve until no pixel set in this mask is left\n");
+  printf("  -V  carve a Y4M video from stdin to stdout\n");
+  printf("  -B  carve every image of a directory or manifest into -o\n");
+  printf("  -p  search seams of the batch on a gradient this many times "
+         "smaller\n      first, 2 or 4 for 4K and up\n");
+  printf("  -S  carve every image of the batch in this many strips side by "
+         "side,\n      one thread each, for wide panoramas\n");
+  printf("  -X  carve at most this fraction of the width of every image of "
+         "the batch,\n      stopping early at seams of more than cost "
+         "times the mean energy (0.5),\n      and scale down the rest\n");
+  printf("  -D  serve carving requests on a Unix domain socket\n");
+  printf("  -j  threads of the batch and server modes, one per core by "
+         "default\n");
+  printf("  -q  requests the server queues before it stops reading, twice "
+         "the\n      threads by default\n");
+  printf("  -m  memory budget in MiB of the tiled mode (default 256), or of "
+         "the pixels\n      in flight in the server (default 4096)\n");
+  printf("  -b  carve for up to this many milliseconds every frame\n");
 }
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("Usage: %s <image>", argv[0]);
+  bool tiled = false;
+  bool video = false;
+  bool batch = false;
+  const char *socket_path = NULL;
+  const char *remove_path = NULL;
+  int threads = 0;
+  int queue_depth = 0;
+  int pyramid = 0;
+  int strips = 0;
+  float hybrid = 0;
+  float hybrid_cost = BATCH_HYBRID_COST;
+  float target_scale = 0.5f;
+  bool target_percent = false;
+  int target_width = 0;
+  int target_height = 0;
+  size_t budget_mib = 0;
+  double frame_budget_ms = 0;
+  trace_init();
+  perf_init();
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:o:TVBD:j:q:W:H:m:b:P:R:p:S:X:h")) != -1) {
+    switch (opt) {
+    case 's':
+      if (sscanf(optarg, "%dx%d", &raw_width, &raw_height) != 2) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'T':
+      tiled = true;
+      break;
+    case 'V':
+      video = true;
+      break;
+    case 'B':
+      batch = true;
+      break;
+    case 'D':
+      socket_path = optarg;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'q':
+      queue_depth = atoi(optarg);
+      break;
+    case 'W':
+      if (optarg[0] == '\0') {
+        usage(argv[0]);
+        return 1;
+      }
+      // A percentage only makes sense for a batch of different sizes
+      if (optarg[strlen(optarg) - 1] == '%') {
+        target_scale = atof(optarg) / 100;
+        target_percent = true;
+      } else {
+        target_width = atoi(optarg);
+      }
+      break;
+    case 'H':
+      target_height = atoi(optarg);
+      break;
+    case 'm':
+      budget_mib = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      frame_budget_ms = atof(optarg);
+      break;
+    case 'P':
+      protect_path = optarg;
+      break;
+    case 'R':
+      remove_path = optarg;
+      break;
+    case 'p':
+      pyramid = atoi(optarg);
+      break;
+    case 'S':
+      strips = atoi(optarg);
+      break;
+    case 'X': {
+      int fields = sscanf(optarg, "%f:%f", &hybrid, &hybrid_cost);
+      if (fields < 1 || !(hybrid > 0 && hybrid <= 1) ||
+          (fields == 2 && !(hybrid_cost > 0))) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    }
+    default:
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
+  if (target_percent && !batch) {
+    fprintf(stderr, "-W takes a percentage of the width in the -B mode only\n");
+    return 1;
+  }
+
+  if (video) {
+    if (target_height > 0) {
+      fprintf(stderr, "The video mode only carves columns\n");
+      return 1;
+    }
+    VideoOptions options = {.target_width = target_width};
+    return video_carve(&options) ? 0 : 1;
+  }
+
+  if (socket_path != NULL) {
+    ServerOptions options = {
+        .socket_path = socket_path,
+        .threads = threads,
+        .queue_depth = queue_depth,
+        .memory = budget_mib << 20,
+    };
+    return server_run(&options) ? 0 : 1;
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
     return 0;
   }
 
-  filepath = argv[1];
+  filepath = argv[optind];
+  if (batch) {
+    if (output_path == NULL || target_height > 0) {
+      usage(argv[0]);
+      return 1;
+    }
+    BatchOptions options = {
+        .input = filepath,
+        .output_dir = output_path,
+        .threads = threads,
+        .target_width = target_width,
+        .target_scale = target_scale,
+        .pyramid = pyramid,
+        .strips = strips,
+        .hybrid = hybrid,
+        .hybrid_cost = hybrid_cost,
+    };
+    return batch_carve(&options) ? 0 : 1;
+  }
+
+  if (remove_path != NULL) {
+    if (output_path == NULL) {
+      usage(argv[0]);
+      return 1;
+    }
+    RemovalOptions options = {
+        .input = filepath,
+        .output = output_path,
+        .protect = protect_path,
+        .remove = remove_path,
+        .raw_width = raw_width,
+        .raw_height = raw_height,
+    };
+    return object_remove(&options) ? 0 : 1;
+  }
+
+  if (tiled) {
+    if (output_path == NULL) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (target_height > 0) {
+      fprintf(stderr, "The tiled mode only carves columns\n");
+      return 1;
+    }
+    TiledOptions options = {
+        .input = filepath,
+        .output = output_path,
+        .raw_width = raw_width,
+        .raw_height = raw_height,
+        .target_width = target_width,
+        .budget = (budget_mib > 0 ? budget_mib : 256) << 20,
+    };
+    return tiled_carve(&options) ? 0 : 1;
+  }
+
+  min_width = target_width;
+  min_height = target_height;
+  perf_group_open(&render_perf);
   set_state();
 
   InitWindow(WIDTH, HEIGHT, "Seam carving");
-  int stride = img.width;
-  int *seam = calloc(img.height, sizeof(*seam));
-  int seams_to_remove = 1000;
-  seams_removed = 0;
+  int stride = img_stride;
+  int width = img.width;
+  int height = img.height;
 
-  Texture final_tex = {0};
-  bool paused = true;
+  // One texture per view, created once. The carving view is as wide as the
+  // stride so that it can be patched straight from a snapshot.
+  Image full = img;
+  full.width = stride;
+  Texture start_tex = LoadTextureFromImage(full);
+  Texture carve_tex = LoadTextureFromImage(full);
+  view_load(&luminance_view);
+  view_load(&gradient_view);
+  worker_start(frame_budget_ms / 1000);
+
+  int box_width = min_width;
+  int box_height = min_height;
+  bool edit_width = false;
+  bool edit_height = false;
 
-  int frame = 0;
-  size_t rate = 128;
-  bool show_seam = true;
   while (!WindowShouldClose()) {
-    if (IsKeyPressed(KEY_ONE)) {
-      reset_state();
-      state = STATE_START;
-    } else if (IsKeyPressed(KEY_TWO)) {
-      state = STATE_LUMINANCE;
-    } else if (IsKeyPressed(KEY_THREE)) {
-      state = STATE_GRADIENT;
-    } else if (IsKeyPressed(KEY_FOUR)) {
-      reset_state();
-      state = STATE_SEAM_REMOVAL;
-    } else if (IsKeyPressed(KEY_UP)) {
-      if (rate >= 2) {
-        rate /= 2;
-      }
-    } else if (IsKeyPressed(KEY_DOWN)) {
-      if (rate <= 1024) {
-        rate *= 2;
-      }
-    } else if (IsKeyPressed(KEY_SPACE)) {
-      paused = !paused;
+    TRACE_SCOPE("frame");
+    // Digits typed into the target boxes are not shortcuts
+    if (!edit_width && !edit_height) {
+      handle_keys();
+    }
+
+    // The idle check comes first: a snapshot published before the worker
+    // went idle is then sure to be picked up below.
+    bool idle = atomic_load(&worker.idle_at) == commands_sent;
+    Snapshot *snap;
+    bool fresh = snapshot_acquire(&worker.snapshots, &snap);
+    if (fresh) {
+      perf_begin(&render_perf);
+      texture_update_columns(carve_tex, snap->img, stride, snap->x0,
+                             snap->img.width, staging.data);
+      perf_end(&render_perf, &stage_perf[STAGE_UPLOAD]);
+      box_width = edit_width ? box_width : snap->target_width;
+      box_height = edit_height ? box_height : snap->target_height;
+    }
+
+    // Nothing changes on screen until the next input event
+    if (idle && !fresh) {
+      EnableEventWaiting();
+    } else {
+      DisableEventWaiting();
     }
 
     BeginDrawing();
     ClearBackground(BLACK);
     switch (state) {
     case STATE_START: {
-      Texture tex = LoadTextureFromImage(img);
-      DrawTexture(tex, WIDTH / 2 - img.width / 2, HEIGHT / 2 - img.height / 2,
-                  WHITE);
+      Rectangle source = {0, 0, width, height};
+      Vector2 position = {WIDTH / 2 - width / 2, HEIGHT / 2 - height / 2};
+      DrawTextureRec(start_tex, source, position, WHITE);
       break;
     }
     case STATE_LUMINANCE:
-      draw_mat(initial_luminance);
+      view_draw(&luminance_view);
       break;
     case STATE_GRADIENT:
-      draw_mat(initial_gradient);
+      view_draw(&gradient_view);
       break;
     case STATE_SEAM_REMOVAL: {
-      Color *data = img.data;
-      frame += 1;
-      if (seams_removed < seams_to_remove) {
-        if (final_tex.id != 0) {
-          UnloadTexture(final_tex);
-        }
-
-        if (show_seam || paused) {
-          gradient_to_dp(gradient, dp);
-          compute_seam(dp, seam);
-          for (int y = 0; y < img.height; y++) {
-            int cx = seam[y];
-            data[(y)*stride + (cx)] = RED;
-          }
-          if (frame % rate == 0) {
-            show_seam = false;
-          }
-        } else {
-          for (int cy = 0; cy < img.height; ++cy) {
-            int cx = seam[cy];
-            img_remove_column_at_row(img, cy, cx, stride);
-            mat_remove_column_at_row(luminance, cy, cx);
-            mat_remove_column_at_row(gradient, cy, cx);
-          }
-
-          img.width -= 1;
-          luminance.width -= 1;
-          gradient.width -= 1;
-          dp.width -= 1;
-          seams_removed += 1;
-          show_seam = true;
-        }
-        Image new = img_alloc(img, stride);
-        final_tex = LoadTextureFromImage(new);
-      }
-      DrawTexture(final_tex, WIDTH / 2 - img.width / 2,
-                  HEIGHT / 2 - img.height / 2, WHITE);
-
+      Rectangle visible = {0, 0, snap->img.width, snap->img.height};
+      Vector2 position = {WIDTH / 2 - snap->img.width / 2,
+                          HEIGHT / 2 - snap->img.height / 2};
+      DrawTextureRec(carve_tex, visible, position, WHITE);
       break;
     }
     }
+
+    // The target is sent once a box is left
+    if (GuiValueBox((Rectangle){70, 10, 80, 24}, "Width ", &box_width,
+                    min_width, width, edit_width)) {
+      edit_width = !edit_width;
+      if (!edit_width) {
+        send_target(box_width, box_height);
+      }
+    }
+    if (GuiValueBox((Rectangle){70, 40, 80, 24}, "Height ", &box_height,
+                    min_height, height, edit_height)) {
+      edit_height = !edit_height;
+      if (!edit_height) {
+        send_target(box_width, box_height);
+      }
+    }
     EndDrawing();
   }
 
+  worker_stop();
+  perf_report();
+  perf_group_close(&render_perf);
+  UnloadTexture(start_tex);
+  UnloadTexture(carve_tex);
+  UnloadTexture(luminance_view.tex);
+  UnloadTexture(gradient_view.tex);
+  CloseWindow();
   return 0;
 }
@@ -0,0 +1,167 @@
+#include "perf.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool perf_enabled;
+static atomic_bool perf_warned;
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} perf_events[PERF_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+// As laid out by PERF_FORMAT_GROUP with both times
+typedef struct {
+  uint64_t nr;
+  uint64_t time_enabled;
+  uint64_t time_running;
+  uint64_t values[PERF_COUNTERS];
+} PerfRead;
+
+void perf_init() {
+  const char *env = getenv("SEAM_PERF");
+  perf_enabled = env != NULL && env[0] != '\0';
+}
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd) {
+  return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+bool perf_group_open(PerfGroup *group) {
+  *group = (PerfGroup){0};
+  if (!perf_enabled) {
+    return false;
+  }
+
+  int leader = -1;
+  int error = 0;
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = perf_events[i].type,
+        .config = perf_events[i].config,
+        .read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING,
+        .disabled = leader < 0,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    group->fds[i] = perf_event_open(&attr, leader);
+    if (group->fds[i] < 0) {
+      error = errno;
+      continue;
+    }
+    leader = leader < 0 ? group->fds[i] : leader;
+    group->opened++;
+  }
+
+  if (leader < 0) {
+    // Said once, however many threads try
+    if (!atomic_exchange(&perf_warned, true)) {
+      fprintf(stderr, "No hardware counters: %s\n", strerror(error));
+    }
+    return false;
+  }
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return true;
+}
+
+void perf_group_close(PerfGroup *group) {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (group->opened > 0 && group->fds[i] >= 0) {
+      close(group->fds[i]);
+    }
+  }
+  *group = (PerfGroup){0};
+}
+
+// Counts since the group was opened, scaled for the time it was not
+// scheduled
+static bool perf_read(PerfGroup *group, double *counts) {
+  int leader = -1;
+  for (int i = 0; i < PERF_COUNTERS && leader < 0; i++) {
+    leader = group->fds[i];
+  }
+  PerfRead r;
+  if (read(leader, &r, sizeof(r)) < (ssize_t)(3 * sizeof(uint64_t))) {
+    return false;
+  }
+
+  double scale = r.time_running > 0
+                     ? (double)r.time_enabled / r.time_running
+                     : 0.0;
+  int v = 0;
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    counts[i] = group->fds[i] >= 0 && v < (int)r.nr ? r.values[v++] * scale
+                                                     : 0.0;
+  }
+  return true;
+}
+
+void perf_begin(PerfGroup *group) {
+  if (group->opened > 0) {
+    perf_read(group, group->start);
+  }
+}
+
+void perf_end(PerfGroup *group, PerfTotals *totals) {
+  double counts[PERF_COUNTERS];
+  if (group->opened == 0 || !perf_read(group, counts)) {
+    return;
+  }
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (group->fds[i] >= 0) {
+      totals->counts[i] += counts[i] - group->start[i];
+      totals->counted[i] = true;
+    }
+  }
+  totals->runs++;
+}
+
+double perf_ratio(const PerfTotals *totals, PerfCounter num,
+                  PerfCounter den) {
+  if (!totals->counted[num] || !totals->counted[den] ||
+      totals->counts[den] <= 0) {
+    return -1;
+  }
+  return totals->counts[num] / totals->counts[den];
+}
+
+void perf_format(const PerfTotals *totals, char *out, size_t size) {
+  double ipc = perf_ratio(totals, PERF_INSTRUCTIONS, PERF_CYCLES);
+  double llc = perf_ratio(totals, PERF_LLC_MISSES, PERF_LLC_REFERENCES);
+  double branch = perf_ratio(totals, PERF_BRANCH_MISSES, PERF_BRANCHES);
+
+  size_t used = 0;
+  out[0] = '\0';
+  if (ipc >= 0) {
+    used += snprintf(out + used, size - used, "%.2f IPC", ipc);
+  }
+  if (llc >= 0 && used < size) {
+    used += snprintf(out + used, size - used, "%s%.1f%% LLC miss",
+                     used > 0 ? ", " : "", 100 * llc);
+  }
+  if (branch >= 0 && used < size) {
+    snprintf(out + used, size - used, "%s%.1f%% branch miss",
+             used > 0 ? ", " : "", 100 * branch);
+  }
+  if (out[0] == '\0') {
+    snprintf(out, size, "not counted");
+  }
+}
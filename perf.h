@@ -0,0 +1,56 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Hardware counters around the stages of the pipeline, read through
+perf_event_open. Off unless SEAM_PERF is set when perf_init runs.
+
+Counters count for the thread that opened them, so every thread measuring a
+stage opens its own PerfGroup. The counters of a group are scheduled
+together, and scaled up when the kernel had to share the PMU with other
+groups. A counter the CPU does not have, such as the last level cache on
+some virtual machines, is left out of the report.
+*/
+
+typedef enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_REFERENCES,
+  PERF_LLC_MISSES,
+  PERF_BRANCHES,
+  PERF_BRANCH_MISSES,
+  PERF_COUNTERS,
+} PerfCounter;
+
+typedef struct {
+  // Leader first, -1 for a counter that could not be opened
+  int fds[PERF_COUNTERS];
+  int opened;
+  double start[PERF_COUNTERS];
+} PerfGroup;
+
+// Counts summed over every time a stage ran
+typedef struct {
+  double counts[PERF_COUNTERS];
+  bool counted[PERF_COUNTERS];
+  long runs;
+} PerfTotals;
+
+extern bool perf_enabled;
+
+void perf_init();
+bool perf_group_open(PerfGroup *group);
+void perf_group_close(PerfGroup *group);
+void perf_begin(PerfGroup *group);
+void perf_end(PerfGroup *group, PerfTotals *totals);
+
+// Fills out with "0.60 IPC, 14.0% LLC miss, 1.2% branch miss", or as much
+// of it as was counted
+void perf_format(const PerfTotals *totals, char *out, size_t size);
+double perf_ratio(const PerfTotals *totals, PerfCounter num, PerfCounter den);
+
+#endif // PERF_H
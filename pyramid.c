@@ -0,0 +1,135 @@
+#include "pyramid.h"
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "trace.h"
+
+static int coarse_size(int size, int factor) {
+  return (size + factor - 1) / factor;
+}
+
+size_t pyramid_bytes(int w, int h, int factor) {
+  int cw = coarse_size(w, factor);
+  int ch = coarse_size(h, factor);
+  return 2 * mat_bytes(cw, ch) + arena_bytes(ch, sizeof(int)) +
+         arena_bytes(h, sizeof(int)) + arena_bytes(w, sizeof(float));
+}
+
+Pyramid pyramid_new(Arena *arena, int w, int h, int factor) {
+  assert(factor > 1);
+  int cw = coarse_size(w, factor);
+  int ch = coarse_size(h, factor);
+  Pyramid pyramid = {
+      .factor = factor,
+      // A block for the drift between coarse seams, and one to refine in
+      .radius = 2 * factor,
+      .stale = factor,
+      .removed = PYRAMID_REBUILD,
+      .coarse = mat_alloc(arena, cw, ch, 0.0f),
+      .coarse_dp = mat_alloc(arena, cw, ch, FLT_MAX),
+      .coarse_seam = arena_alloc(arena, ch, sizeof(int)),
+      .guide = arena_alloc(arena, h, sizeof(int)),
+      .line = arena_alloc(arena, w, sizeof(float)),
+  };
+  return pyramid;
+}
+
+// Each coarse cell is the mean of its block, blocks on the right and bottom
+// edges being cut short. The rows of a block are summed whole first, which
+// vectorizes, and the columns after.
+static void pyramid_build(Pyramid *pyramid, Mat gradient) {
+  int f = pyramid->factor;
+  int w = gradient.width;
+  float *sum = pyramid->line;
+  Mat coarse = pyramid->coarse;
+  coarse.width = coarse_size(w, f);
+  for (int cy = 0; cy < coarse.height; cy++) {
+    int y0 = cy * f;
+    int y1 = y0 + f < gradient.height ? y0 + f : gradient.height;
+    memcpy(sum, MAT_ROW(gradient, y0), w * sizeof(float));
+    for (int y = y0 + 1; y < y1; y++) {
+      const float *row = MAT_ROW(gradient, y);
+      for (int x = 0; x < w; x++) {
+        sum[x] += row[x];
+      }
+    }
+
+    float *out = MAT_ROW(coarse, cy);
+    for (int cx = 0; cx < coarse.width; cx++) {
+      int x0 = cx * f;
+      int x1 = x0 + f < w ? x0 + f : w;
+      float block = 0.0f;
+      for (int x = x0; x < x1; x++) {
+        block += sum[x];
+      }
+      out[cx] = block / ((y1 - y0) * (x1 - x0));
+    }
+  }
+  pyramid->coarse = coarse;
+  pyramid->coarse_dp.width = coarse.width;
+  pyramid->removed = 0;
+}
+
+static void pyramid_remove(Pyramid *pyramid) {
+  for (int cy = 0; cy < pyramid->coarse.height; cy++) {
+    mat_remove_column_at_row(pyramid->coarse, cy, pyramid->coarse_seam[cy]);
+  }
+  pyramid->coarse.width--;
+  pyramid->coarse_dp.width--;
+  pyramid->removed++;
+}
+
+/*
+The guide runs through the centres of the blocks of the coarse seam, and
+straight from one to the next in between. A coarse seam moves by at most a
+block per block row, so the guide moves by at most a column per row; the
+clamp only guards against rounding.
+*/
+static void pyramid_guide(Pyramid *pyramid, int h) {
+  int f = pyramid->factor;
+  int ch = pyramid->coarse.height;
+  const int *coarse_seam = pyramid->coarse_seam;
+  for (int y = 0; y < h; y++) {
+    float at = (y + 0.5f) / f - 0.5f;
+    int j0 = at > 0 ? (int)at : 0;
+    j0 = j0 < ch - 1 ? j0 : ch - 1;
+    int j1 = j0 + 1 < ch ? j0 + 1 : j0;
+    float t = fminf(fmaxf(at - j0, 0.0f), 1.0f);
+    float cx = coarse_seam[j0] + t * (coarse_seam[j1] - coarse_seam[j0]);
+    // The centre of the block is at (cx + 0.5) * f - 0.5, rounded here
+    int x = (int)((cx + 0.5f) * f);
+    if (y > 0) {
+      int prev = pyramid->guide[y - 1];
+      x = x < prev - 1 ? prev - 1 : x > prev + 1 ? prev + 1 : x;
+    }
+    pyramid->guide[y] = x;
+  }
+}
+
+void pyramid_seam(Pyramid *pyramid, Mat gradient, Mat dp, int *seam) {
+  if (pyramid->stale >= pyramid->factor) {
+    TRACE_SCOPE("coarse_seam");
+    if (pyramid->removed >= PYRAMID_REBUILD) {
+      pyramid_build(pyramid, gradient);
+    } else {
+      pyramid_remove(pyramid);
+    }
+    pyramid->stale = 0;
+    gradient_to_dp(pyramid->coarse, pyramid->coarse_dp);
+    compute_seam(pyramid->coarse_dp, pyramid->coarse_seam);
+    pyramid_guide(pyramid, gradient.height);
+  }
+  pyramid->stale++;
+
+  // A coarse column is worth factor full ones, so the guide serves as many
+  // seams. Those removed meanwhile may leave it past the last column.
+  int *guide = pyramid->guide;
+  for (int y = 0; y < gradient.height; y++) {
+    guide[y] = guide[y] < gradient.width ? guide[y] : gradient.width - 1;
+  }
+  TRACE_SCOPE("guided_seam");
+  guided_seam(gradient, guide, pyramid->radius, dp, seam);
+}
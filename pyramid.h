@@ -0,0 +1,49 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "carve.h"
+
+/*
+Coarse-to-fine seam search for large images. Where a seam goes is mostly
+decided by the low frequencies of the energy, so the full DP is run on the
+gradient averaged over factor x factor blocks, and the seam found there is
+scaled back up into a guide for guided_seam, which only searches a band a
+few blocks wide around it at full resolution.
+
+A coarse column stands for factor full ones, so a coarse seam guides
+factor seams in a row. In between, the seams removed shift the columns by
+less than a block, which the band leaves room for. The coarse seam is then
+removed from the coarse gradient, which stays true to the full one away
+from the seams removed, and is only averaged afresh every PYRAMID_REBUILD
+coarse seams.
+*/
+// Smallest coarse gradient, in blocks a side, worth searching
+#define PYRAMID_MIN_BLOCKS 16
+#define PYRAMID_REBUILD 8
+
+typedef struct {
+  int factor;
+  int radius;
+  // Seams found with the current coarse seam, and coarse seams removed
+  // since the coarse gradient was last built
+  int stale;
+  int removed;
+  Mat coarse;
+  Mat coarse_dp;
+  int *coarse_seam;
+  int *guide;
+  // A row of the gradient summed over a block
+  float *line;
+} Pyramid;
+
+size_t pyramid_bytes(int w, int h, int factor);
+Pyramid pyramid_new(Arena *arena, int w, int h, int factor);
+
+// Every call after the first is taken to follow the removal of the seam
+// found by the one before. dp is the scratch Mat of guided_seam.
+void pyramid_seam(Pyramid *pyramid, Mat gradient, Mat dp, int *seam);
+
+#endif // PYRAMID_H
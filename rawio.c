@@ -0,0 +1,449 @@
+#include "rawio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static bool has_extension(const char *path, const char *ext) {
+  const char *dot = strrchr(path, '.');
+  return dot != NULL && strcasecmp(dot, ext) == 0;
+}
+
+RawFormat raw_image_format(const char *path) {
+  if (has_extension(path, ".rgba") || has_extension(path, ".raw")) {
+    return RAW_RGBA;
+  }
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return RAW_NONE;
+  }
+
+  char magic[2] = {0};
+  size_t n = fread(magic, 1, sizeof(magic), f);
+  fclose(f);
+  if (n == 2 && magic[0] == 'P' && magic[1] == '7') {
+    return RAW_PAM;
+  }
+  if (n == 2 && magic[0] == 'P' && magic[1] == '6') {
+    return RAW_PPM;
+  }
+  return RAW_NONE;
+}
+
+static bool is_space(uint8_t c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+         c == '\v';
+}
+
+// Reads an unsigned decimal from a netpbm header, skipping whitespace and
+// comments. Leaves pos on the character right after the number.
+static bool pnm_number(const uint8_t *p, size_t size, size_t *pos, int *value) {
+  size_t i = *pos;
+  while (i < size && (is_space(p[i]) || p[i] == '#')) {
+    if (p[i] == '#') {
+      while (i < size && p[i] != '\n') {
+        i++;
+      }
+    } else {
+      i++;
+    }
+  }
+
+  if (i >= size || p[i] < '0' || p[i] > '9') {
+    return false;
+  }
+
+  long v = 0;
+  while (i < size && '0' <= p[i] && p[i] <= '9') {
+    v = v * 10 + (p[i] - '0');
+    if (v > INT_MAX) {
+      return false;
+    }
+    i++;
+  }
+
+  *value = (int)v;
+  *pos = i;
+  return true;
+}
+
+static bool ppm_header(const uint8_t *p, size_t size, RawImage *raw) {
+  size_t pos = 2;
+  int maxval = 0;
+  if (!pnm_number(p, size, &pos, &raw->width) ||
+      !pnm_number(p, size, &pos, &raw->height) ||
+      !pnm_number(p, size, &pos, &maxval)) {
+    return false;
+  }
+
+  // Exactly one whitespace character separates the header from the raster
+  if (pos >= size || !is_space(p[pos]) || maxval != 255) {
+    return false;
+  }
+
+  raw->depth = 3;
+  raw->offset = pos + 1;
+  return true;
+}
+
+static bool pam_header(const uint8_t *header, size_t size, RawImage *raw) {
+  const char *p = (const char *)header;
+  size_t pos = 3;
+  int maxval = 0;
+
+  while (pos < size) {
+    const char *line = p + pos;
+    const char *end = memchr(line, '\n', size - pos);
+    if (end == NULL) {
+      return false;
+    }
+    pos = end - p + 1;
+
+    size_t len = end - line;
+    size_t value = 0;
+    int *field = NULL;
+    if (len >= 6 && strncmp(line, "ENDHDR", 6) == 0) {
+      raw->offset = pos;
+      return raw->depth >= 3 && raw->depth <= 4 && maxval == 255;
+    } else if (len > 6 && strncmp(line, "WIDTH ", 6) == 0) {
+      field = &raw->width;
+      value = 6;
+    } else if (len > 7 && strncmp(line, "HEIGHT ", 7) == 0) {
+      field = &raw->height;
+      value = 7;
+    } else if (len > 6 && strncmp(line, "DEPTH ", 6) == 0) {
+      field = &raw->depth;
+      value = 6;
+    } else if (len > 7 && strncmp(line, "MAXVAL ", 7) == 0) {
+      field = &maxval;
+      value = 7;
+    }
+
+    // TUPLTYPE and comments carry no information we need: the depth already
+    // tells RGB from RGB_ALPHA.
+    if (field != NULL) {
+      size_t at = 0;
+      if (!pnm_number((const uint8_t *)line + value, len - value, &at, field)) {
+        return false;
+      }
+    }
+  }
+
+  return false;
+}
+
+/*
+Reads the header of a raw image without mapping it and checks that the file
+holds the whole raster. Headers are expected to fit in the first 4 KiB.
+*/
+bool raw_image_probe(const char *path, int width, int height, RawImage *raw) {
+  *raw = (RawImage){0};
+  raw->format = raw_image_format(path);
+  if (raw->format == RAW_NONE) {
+    return false;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  uint8_t header[4096];
+  ssize_t n = 0;
+  if (fstat(fd, &st) == 0) {
+    n = pread(fd, header, sizeof(header), 0);
+  }
+  close(fd);
+  if (n <= 0) {
+    return false;
+  }
+
+  bool ok = false;
+  switch (raw->format) {
+  case RAW_PAM:
+    ok = pam_header(header, n, raw);
+    break;
+  case RAW_PPM:
+    ok = ppm_header(header, n, raw);
+    break;
+  case RAW_RGBA:
+    raw->width = width;
+    raw->height = height;
+    raw->depth = 4;
+    ok = true;
+    break;
+  case RAW_NONE:
+    break;
+  }
+
+  size_t bytes = (size_t)raw->width * raw->height * raw->depth;
+  if (!ok || raw->width <= 0 || raw->height <= 0 ||
+      raw->offset + bytes > (size_t)st.st_size) {
+    fprintf(stderr, "%s: unsupported or truncated raw image\n", path);
+    return false;
+  }
+
+  raw->in_place = raw->depth == 4;
+  raw->map_size = st.st_size;
+  return true;
+}
+
+bool raw_image_open(const char *path, int width, int height, RawImage *raw) {
+  if (!raw_image_probe(path, width, height, raw)) {
+    return false;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  // Writable private mapping: the file is never modified, carving only
+  // dirties private copies of the pages it touches.
+  raw->map = mmap(NULL, raw->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                  fd, 0);
+  close(fd);
+  if (raw->map == MAP_FAILED) {
+    *raw = (RawImage){0};
+    return false;
+  }
+
+  madvise(raw->map, raw->map_size, MADV_WILLNEED);
+  return true;
+}
+
+static bool pread_all(int fd, void *data, size_t len, off_t offset) {
+  uint8_t *p = data;
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+/*
+Reads count rows starting at row y from an open raw image file into out as
+packed RGBA. RGB rows are read into the tail of out and expanded front to
+back, which never overtakes the bytes still to be expanded.
+*/
+bool raw_image_read_rows(int fd, const RawImage *raw, int y, int count,
+                         Color *out) {
+  size_t pixels = (size_t)raw->width * count;
+  off_t offset = raw->offset + (off_t)raw->width * y * raw->depth;
+  if (raw->depth == 4) {
+    return pread_all(fd, out, pixels * sizeof(Color), offset);
+  }
+
+  uint8_t *src = (uint8_t *)out + pixels;
+  if (!pread_all(fd, src, pixels * 3, offset)) {
+    return false;
+  }
+  for (size_t i = 0; i < pixels; i++) {
+    out[i] = (Color){src[3 * i], src[3 * i + 1], src[3 * i + 2], 255};
+  }
+  return true;
+}
+
+/*
+Returns the original pixels of a mapped image. For RGBA files the result
+points into the mapping itself and any private pages left over from a
+previous job are dropped first, so the file contents show through again.
+RGB files are expanded into buffer, which must hold width * height pixels.
+*/
+Image raw_image_pixels(RawImage *raw, Color *buffer) {
+  Image img = {0};
+  img.width = raw->width;
+  img.height = raw->height;
+  img.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+  img.mipmaps = 1;
+
+  uint8_t *src = raw->map + raw->offset;
+  if (raw->in_place) {
+    madvise(raw->map, raw->map_size, MADV_DONTNEED);
+    img.data = src;
+    return img;
+  }
+
+  size_t pixels = (size_t)raw->width * raw->height;
+  for (size_t i = 0; i < pixels; i++) {
+    buffer[i] = (Color){src[3 * i], src[3 * i + 1], src[3 * i + 2], 255};
+  }
+  img.data = buffer;
+  return img;
+}
+
+void raw_image_close(RawImage *raw) {
+  if (raw->map != NULL) {
+    munmap(raw->map, raw->map_size);
+  }
+  *raw = (RawImage){0};
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+  const uint8_t *p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool writev_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+// Gathers the visible part of each row straight from the strided buffer.
+static bool write_rgba_rows(int fd, const Color *data, int width, int count,
+                            int stride) {
+  if (stride == width) {
+    return write_all(fd, data, (size_t)width * count * sizeof(Color));
+  }
+
+  struct iovec iov[IOV_MAX];
+  for (int y = 0; y < count;) {
+    int n = 0;
+    for (; n < IOV_MAX && y < count; n++, y++) {
+      iov[n].iov_base = (void *)&data[(size_t)y * stride];
+      iov[n].iov_len = (size_t)width * sizeof(Color);
+    }
+    if (!writev_all(fd, iov, n)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool write_rgb_rows(int fd, const Color *data, int width, int count,
+                           int stride) {
+  uint8_t chunk[3 * 4096];
+  for (int y = 0; y < count; y++) {
+    const Color *row = &data[(size_t)y * stride];
+    for (int x = 0; x < width;) {
+      int n = 0;
+      for (; n < 4096 && x < width; n++, x++) {
+        chunk[3 * n] = row[x].r;
+        chunk[3 * n + 1] = row[x].g;
+        chunk[3 * n + 2] = row[x].b;
+      }
+      if (!write_all(fd, chunk, 3 * n)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+Streams an RGBA image out a few rows at a time, each batch with its own
+stride. The format follows the extension: .ppm drops alpha, .rgba and .raw
+have no header and anything else is written as PAM.
+*/
+bool raw_writer_open(RawWriter *writer, const char *path, int width,
+                     int height) {
+  *writer = (RawWriter){0};
+  writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd < 0) {
+    return false;
+  }
+  writer->width = width;
+  writer->rgb = has_extension(path, ".ppm");
+
+  char header[128];
+  int len = 0;
+  if (writer->rgb) {
+    len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width,
+                   height);
+  } else if (!has_extension(path, ".rgba") && !has_extension(path, ".raw")) {
+    len = snprintf(header, sizeof(header),
+                   "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\n"
+                   "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+                   width, height);
+  }
+
+  writer->ok = write_all(writer->fd, header, len);
+  if (!writer->ok) {
+    close(writer->fd);
+    writer->fd = -1;
+  }
+  return writer->ok;
+}
+
+// Writes headerless RGBA to a descriptor the caller keeps ownership of
+void raw_writer_fd(RawWriter *writer, int fd, int width) {
+  *writer = (RawWriter){0};
+  writer->fd = fd;
+  writer->width = width;
+  writer->ok = true;
+}
+
+bool raw_writer_rows(RawWriter *writer, const Color *rows, int count,
+                     int stride) {
+  if (writer->ok) {
+    writer->ok =
+        writer->rgb
+            ? write_rgb_rows(writer->fd, rows, writer->width, count, stride)
+            : write_rgba_rows(writer->fd, rows, writer->width, count, stride);
+  }
+  return writer->ok;
+}
+
+bool raw_writer_close(RawWriter *writer) {
+  bool ok = close(writer->fd) == 0 && writer->ok;
+  *writer = (RawWriter){0};
+  return ok;
+}
+
+bool raw_image_write(const char *path, Image img, int stride) {
+  RawWriter writer;
+  if (!raw_writer_open(&writer, path, img.width, img.height)) {
+    return false;
+  }
+  raw_writer_rows(&writer, img.data, img.height, stride);
+  return raw_writer_close(&writer);
+}
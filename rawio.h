@@ -0,0 +1,58 @@
+#ifndef RAWIO_H
+#define RAWIO_H
+
+#include <raylib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Uncompressed formats that can be memory-mapped instead of decoded: PAM (P7),
+binary PPM (P6) and headerless RGBA, whose size has to be given by the caller.
+Files holding 8-bit RGBA are mapped copy-on-write and carved in place, so
+only the pages touched by seam removal ever get copied. RGB files are mapped
+read-only and expanded once into a caller-provided buffer.
+*/
+
+typedef enum {
+  RAW_NONE,
+  RAW_PAM,
+  RAW_PPM,
+  RAW_RGBA,
+} RawFormat;
+
+typedef struct {
+  RawFormat format;
+  int width;
+  int height;
+  int depth;
+  bool in_place;
+  uint8_t *map;
+  size_t map_size;
+  size_t offset;
+} RawImage;
+
+typedef struct {
+  int fd;
+  int width;
+  bool rgb;
+  bool ok;
+} RawWriter;
+
+RawFormat raw_image_format(const char *path);
+bool raw_image_probe(const char *path, int width, int height, RawImage *raw);
+bool raw_image_open(const char *path, int width, int height, RawImage *raw);
+Image raw_image_pixels(RawImage *raw, Color *buffer);
+void raw_image_close(RawImage *raw);
+bool raw_image_read_rows(int fd, const RawImage *raw, int y, int count,
+                         Color *out);
+
+bool raw_writer_open(RawWriter *writer, const char *path, int width,
+                     int height);
+void raw_writer_fd(RawWriter *writer, int fd, int width);
+bool raw_writer_rows(RawWriter *writer, const Color *rows, int count,
+                     int stride);
+bool raw_writer_close(RawWriter *writer);
+bool raw_image_write(const char *path, Image img, int stride);
+
+#endif // RAWIO_H
@@ -0,0 +1,184 @@
+#include "removal.h"
+
+#include <float.h>
+#include <raylib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "carve.h"
+#include "rawio.h"
+#include "trace.h"
+
+// An empty mask without a path
+static bool load_mask(Arena *arena, const char *path, int w, int h,
+                      Mask *mask) {
+  if (path == NULL) {
+    *mask = mask_alloc(arena, w, h);
+    return true;
+  }
+
+  Image img = LoadImage(path);
+  if (img.data == NULL) {
+    fprintf(stderr, "Could not load %s\n", path);
+    return false;
+  }
+  bool ok = img.width == w && img.height == h;
+  if (ok) {
+    ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    *mask = mask_from_image(arena, img, w);
+  } else {
+    fprintf(stderr, "%s is %dx%d, the image %dx%d\n", path, img.width,
+            img.height, w, h);
+  }
+  UnloadImage(img);
+  return ok;
+}
+
+// Pixels of mask on the seam
+static long seam_crossing(Mask mask, const int *seam) {
+  long crossed = 0;
+  for (int y = 0; y < mask.height; y++) {
+    crossed += MASK_AT(mask, y, seam[y]);
+  }
+  return crossed;
+}
+
+size_t removal_bytes(int w, int h) {
+  return 3 * mat_bytes(w, h) + arena_bytes(h, sizeof(int));
+}
+
+// Energy and DP of the image as carved so far
+static void removal_energy(Arena *arena, Image img, int stride, Mask protect,
+                           Mask remove, float bonus, Mat gradient, Mat dp) {
+  TRACE_SCOPE("sobel_filter");
+  size_t mark = arena_mark(arena);
+  Mat luminance = image_luminance(arena, img, stride);
+  sobel_filter_masked(luminance, gradient, protect, remove, bonus);
+  gradient_to_dp(gradient, dp);
+  arena_rewind(arena, mark);
+}
+
+/*
+Pixels to remove start out SOBEL_MAX cheaper than their energy, which is
+enough for the seams of most objects while keeping those seams' energies
+apart. Whenever the cheapest seam misses them all the bonus grows, and the
+energy is computed again, up to where no seam that misses can win.
+*/
+bool removal_carve(Arena *arena, Image *img, int stride, Mask *protect,
+                   Mask *remove) {
+  int h = img->height;
+  size_t mark = arena_mark(arena);
+  Mat gradient = mat_alloc(arena, img->width, h, 0.0f);
+  Mat dp = mat_alloc(arena, img->width, h, FLT_MAX);
+  int *seam = arena_alloc(arena, h, sizeof(int));
+
+  float bonus = SOBEL_MAX;
+  float most = SOBEL_MAX * (h + 1);
+  long left = mask_count(*remove);
+  if (left > 0) {
+    removal_energy(arena, *img, stride, *protect, *remove, bonus, gradient,
+                   dp);
+  }
+
+  // The masks are carved along with the image, to tell when the remove one
+  // is empty and for the energy to be computed again
+  bool ok = true;
+  while (left > 0 && img->width > 1) {
+    {
+      TRACE_SCOPE("compute_seam");
+      compute_seam(dp, seam);
+    }
+    if (seam_crossing(*protect, seam) > 0) {
+      fprintf(stderr, "%ld pixels to remove are past a wall of protected "
+                      "ones\n", left);
+      ok = false;
+      break;
+    }
+    long crossed = seam_crossing(*remove, seam);
+    if (crossed == 0 && bonus < most) {
+      bonus = bonus * 16 < most ? bonus * 16 : most;
+      removal_energy(arena, *img, stride, *protect, *remove, bonus, gradient,
+                     dp);
+      continue;
+    }
+    if (crossed == 0) {
+      fprintf(stderr, "%ld pixels to remove are walled in by protected "
+                      "ones\n", left);
+      break;
+    }
+    left -= crossed;
+
+    {
+      TRACE_SCOPE("remove_seam");
+      for (int y = 0; y < h; y++) {
+        img_remove_column_at_row(*img, y, seam[y], stride);
+        mat_remove_column_at_row(gradient, y, seam[y]);
+        mat_remove_column_at_row(dp, y, seam[y]);
+        mask_remove_column_at_row(*protect, y, seam[y]);
+        mask_remove_column_at_row(*remove, y, seam[y]);
+      }
+      img->width--;
+      gradient.width--;
+      dp.width--;
+      protect->width--;
+      remove->width--;
+    }
+    TRACE_SCOPE("dp_after_seam");
+    dp_after_seam(gradient, dp, seam);
+  }
+
+  arena_rewind(arena, mark);
+  return ok;
+}
+
+bool object_remove(const RemovalOptions *options) {
+  RawImage raw = {0};
+  Image img = {0};
+  bool mapped = raw_image_open(options->input, options->raw_width,
+                               options->raw_height, &raw);
+  if (mapped) {
+    img.width = raw.width;
+    img.height = raw.height;
+  } else {
+    img = LoadImage(options->input);
+    if (img.data == NULL) {
+      fprintf(stderr, "Could not load %s\n", options->input);
+      return false;
+    }
+    ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  }
+
+  int w = img.width;
+  int h = img.height;
+  size_t pixels = mapped && !raw.in_place ? (size_t)w * h : 0;
+  Arena arena = arena_new(arena_bytes(pixels, sizeof(Color)) +
+                          2 * mask_bytes(w, h) + removal_bytes(w, h));
+  if (mapped) {
+    Color *buffer = raw.in_place ? NULL : arena_alloc(&arena, pixels,
+                                                      sizeof(Color));
+    img = raw_image_pixels(&raw, buffer);
+  }
+
+  Mask protect;
+  Mask remove;
+  bool ok = load_mask(&arena, options->protect, w, h, &protect) &&
+            load_mask(&arena, options->remove, w, h, &remove) &&
+            removal_carve(&arena, &img, w, &protect, &remove);
+
+  if (ok) {
+    fprintf(stderr, "Removed %d columns, %dx%d left\n", w - img.width,
+            img.width, h);
+    ok = raw_image_write(options->output, img, w);
+    if (!ok) {
+      fprintf(stderr, "Could not write %s\n", options->output);
+    }
+  }
+  if (mapped) {
+    raw_image_close(&raw);
+  } else {
+    UnloadImage(img);
+  }
+  arena_destroy(&arena);
+  return ok;
+}
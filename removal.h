@@ -0,0 +1,42 @@
+#ifndef REMOVAL_H
+#define REMOVAL_H
+
+#include <raylib.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "carve.h"
+
+/*
+Object removal: carves columns out of an image, without opening a window,
+until none of the pixels set in the remove mask are left, steering clear of
+the pixels set in the protect mask if one is given. Masks are images of the
+same size, set where brighter than mid grey. The masks are packed one bit
+per pixel and carved along with the image; after the first, the DP of every
+seam is only brought up to date around the previous one.
+*/
+typedef struct {
+  const char *input;
+  const char *output;
+  const char *protect;
+  const char *remove;
+  int raw_width;
+  int raw_height;
+} RemovalOptions;
+
+bool object_remove(const RemovalOptions *options);
+
+/*
+The carving of object_remove on an image in memory, stride pixels apart from
+one row to the next, and masks of its size. img and both masks are narrowed
+as columns go. The working memory, removal_bytes of it, comes from arena and
+is given back on return. False, with nothing more carved, if a seam would
+have to cross a protected pixel; pixels to remove walled in by protected
+ones are left where they are.
+*/
+size_t removal_bytes(int w, int h);
+bool removal_carve(Arena *arena, Image *img, int stride, Mask *protect,
+                   Mask *remove);
+
+#endif // REMOVAL_H
@@ -0,0 +1,100 @@
+#include "resample.h"
+
+#include <assert.h>
+#include <math.h>
+
+static int resample_taps(int w, int target) {
+  double scale = (double)w / target;
+  // Rounded up to a whole number of 16-byte vectors
+  int taps = ((int)ceil(2 * RESAMPLE_LOBES * scale) + 1 + 3) & ~3;
+  return taps < w ? taps : w;
+}
+
+size_t resampler_bytes(int w, int target) {
+  int taps = resample_taps(w, target);
+  return arena_bytes(target, sizeof(int)) +
+         arena_bytes((size_t)target * taps, sizeof(float)) +
+         arena_bytes((size_t)4 * w, sizeof(float));
+}
+
+static double sinc(double x) {
+  return x == 0 ? 1 : sin(M_PI * x) / (M_PI * x);
+}
+
+static double lanczos(double x) {
+  return fabs(x) < RESAMPLE_LOBES ? sinc(x) * sinc(x / RESAMPLE_LOBES) : 0;
+}
+
+/*
+Output pixel x covers source pixels x * scale to (x + 1) * scale, so its
+centre falls on (x + 0.5) * scale - 0.5. Near the edges the taps are moved
+inside the row and the weights that are left are brought back to one.
+*/
+Resampler resampler_new(Arena *arena, int w, int target) {
+  assert(0 < target && target <= w);
+  int taps = resample_taps(w, target);
+  Resampler r = {
+      .width = w,
+      .target = target,
+      .taps = taps,
+      .start = arena_alloc(arena, target, sizeof(int)),
+      .weights = arena_alloc(arena, (size_t)target * taps, sizeof(float)),
+      .line = arena_alloc(arena, (size_t)4 * w, sizeof(float)),
+  };
+
+  double scale = (double)w / target;
+  for (int x = 0; x < target; x++) {
+    double centre = (x + 0.5) * scale - 0.5;
+    int start = (int)floor(centre - RESAMPLE_LOBES * scale) + 1;
+    start = start < w - taps ? start : w - taps;
+    start = start > 0 ? start : 0;
+    r.start[x] = start;
+
+    float *weights = &r.weights[(size_t)x * taps];
+    double sum = 0;
+    for (int k = 0; k < taps; k++) {
+      weights[k] = lanczos((start + k - centre) / scale);
+      sum += weights[k];
+    }
+    for (int k = 0; k < taps; k++) {
+      weights[k] /= sum;
+    }
+  }
+  return r;
+}
+
+static unsigned char to_channel(float v) {
+  return v <= 0 ? 0 : v >= 255 ? 255 : (unsigned char)(v + 0.5f);
+}
+
+void resample_row(const Resampler *r, Color *row) {
+  int w = r->width;
+  float *red = r->line;
+  float *green = red + w;
+  float *blue = green + w;
+  float *alpha = blue + w;
+  for (int x = 0; x < w; x++) {
+    red[x] = row[x].r;
+    green[x] = row[x].g;
+    blue[x] = row[x].b;
+    alpha[x] = row[x].a;
+  }
+
+  // Every output pixel only reads the lines, so the row can be overwritten
+  for (int x = 0; x < r->target; x++) {
+    const float *weights = &r->weights[(size_t)x * r->taps];
+    int start = r->start[x];
+    float sr = 0.0f;
+    float sg = 0.0f;
+    float sb = 0.0f;
+    float sa = 0.0f;
+    for (int k = 0; k < r->taps; k++) {
+      sr += weights[k] * red[start + k];
+      sg += weights[k] * green[start + k];
+      sb += weights[k] * blue[start + k];
+      sa += weights[k] * alpha[start + k];
+    }
+    row[x] = (Color){to_channel(sr), to_channel(sg), to_channel(sb),
+                     to_channel(sa)};
+  }
+}
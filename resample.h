@@ -0,0 +1,37 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <raylib.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+/*
+Horizontal downscaling of image rows with a Lanczos-3 filter, stretched by
+the scale so that it also smooths away what the narrower row cannot hold.
+The weights of every output pixel are worked out once for all the rows and
+padded with zeros to the same number of taps, so resampling a row is a dot
+product per pixel and channel over a fixed length the compiler vectorizes.
+A row is spread into one line of floats per channel first, which is all the
+scratch it needs: rows are resampled in place.
+*/
+#define RESAMPLE_LOBES 3
+
+typedef struct {
+  int width;
+  int target;
+  int taps;
+  // First source pixel and weights of every output pixel
+  int *start;
+  float *weights;
+  // The channels of the row being resampled, width floats each
+  float *line;
+} Resampler;
+
+size_t resampler_bytes(int w, int target);
+Resampler resampler_new(Arena *arena, int w, int target);
+
+// Shrinks the first width pixels of row to the first target
+void resample_row(const Resampler *r, Color *row);
+
+#endif // RESAMPLE_H
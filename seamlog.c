@@ -0,0 +1,103 @@
+#include "seamlog.h"
+
+#include <assert.h>
+
+size_t seam_log_bytes(int max_height, int capacity) {
+  size_t n = capacity > 0 ? capacity : 0;
+  size_t entries = n * max_height;
+  return arena_bytes(n, sizeof(int)) + arena_bytes(entries, sizeof(int8_t)) +
+         arena_bytes(entries, sizeof(Color)) +
+         arena_bytes(entries, sizeof(float));
+}
+
+SeamLog seam_log_new(Arena *arena, int max_height, int capacity) {
+  SeamLog log = {0};
+  log.height = max_height;
+  log.max_height = max_height;
+  log.capacity = capacity > 0 ? capacity : 0;
+  size_t entries = (size_t)log.capacity * max_height;
+  log.start = arena_alloc(arena, log.capacity, sizeof(int));
+  log.steps = arena_alloc(arena, entries, sizeof(int8_t));
+  log.pixels = arena_alloc(arena, entries, sizeof(Color));
+  log.energy = arena_alloc(arena, entries, sizeof(float));
+  return log;
+}
+
+void seam_log_clear(SeamLog *log, int height) {
+  assert(height <= log->max_height);
+  log->height = height;
+  log->count = 0;
+  log->cursor = 0;
+}
+
+void seam_log_push(SeamLog *log, const int *seam, Image img, int stride,
+                   Mat gradient) {
+  assert(log->cursor < log->capacity);
+  int i = log->cursor;
+  size_t base = (size_t)i * log->height;
+  Color *pixels = img.data;
+
+  log->start[i] = seam[0];
+  for (int y = 0; y < log->height; y++) {
+    if (y > 0) {
+      log->steps[base + y] = seam[y] - seam[y - 1];
+    }
+    log->pixels[base + y] = pixels[y * stride + seam[y]];
+    log->energy[base + y] = MAT_AT(gradient, y, seam[y], gradient.stride);
+  }
+
+  log->cursor = i + 1;
+  log->count = log->cursor;
+}
+
+void seam_log_seam(const SeamLog *log, int i, int *seam) {
+  assert(0 <= i && i < log->count);
+  const int8_t *steps = &log->steps[(size_t)i * log->height];
+  seam[0] = log->start[i];
+  for (int y = 1; y < log->height; y++) {
+    seam[y] = seam[y - 1] + steps[y];
+  }
+}
+
+bool seam_log_undo(SeamLog *log, Image *img, int stride, Mat *luminance,
+                   Mat *gradient, int *seam) {
+  if (log->cursor == 0) {
+    return false;
+  }
+
+  int i = --log->cursor;
+  size_t base = (size_t)i * log->height;
+  seam_log_seam(log, i, seam);
+  for (int y = 0; y < log->height; y++) {
+    Color pixel = log->pixels[base + y];
+    float lum;
+    luminance_row(&pixel, &lum, 1);
+    img_insert_column_at_row(*img, y, seam[y], stride, pixel);
+    mat_insert_column_at_row(*luminance, y, seam[y], lum);
+    mat_insert_column_at_row(*gradient, y, seam[y], log->energy[base + y]);
+  }
+
+  img->width += 1;
+  luminance->width += 1;
+  gradient->width += 1;
+  return true;
+}
+
+bool seam_log_redo(SeamLog *log, Image *img, int stride, Mat *luminance,
+                   Mat *gradient, int *seam) {
+  if (log->cursor == log->count) {
+    return false;
+  }
+
+  seam_log_seam(log, log->cursor++, seam);
+  for (int y = 0; y < log->height; y++) {
+    img_remove_column_at_row(*img, y, seam[y], stride);
+    mat_remove_column_at_row(*luminance, y, seam[y]);
+    mat_remove_column_at_row(*gradient, y, seam[y]);
+  }
+
+  img->width -= 1;
+  luminance->width -= 1;
+  gradient->width -= 1;
+  return true;
+}
@@ -0,0 +1,53 @@
+#ifndef SEAMLOG_H
+#define SEAMLOG_H
+
+#include <raylib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "carve.h"
+
+/*
+History of the seams removed since the last reset, enough to put every one of
+them back. A seam is stored as its column in the first row followed by one
+step of -1, 0 or 1 per row below, together with the pixels and gradient
+values it took out; luminance is recomputed from the pixels.
+
+Seams before cursor are removed from the image, the ones from cursor up to
+count have been undone and can be redone. Either way is O(height) per seam.
+The height of the seams is set when the log is cleared, up to max_height.
+*/
+typedef struct {
+  int height;
+  int max_height;
+  int capacity;
+  int count;
+  int cursor;
+
+  int *start;
+  int8_t *steps;
+  Color *pixels;
+  float *energy;
+} SeamLog;
+
+size_t seam_log_bytes(int max_height, int capacity);
+SeamLog seam_log_new(Arena *arena, int max_height, int capacity);
+void seam_log_clear(SeamLog *log, int height);
+
+// Records a seam about to be removed, dropping anything left to redo
+void seam_log_push(SeamLog *log, const int *seam, Image img, int stride,
+                   Mat gradient);
+
+// Decodes the columns of seam i
+void seam_log_seam(const SeamLog *log, int i, int *seam);
+
+// Step the cursor back or forth, editing the image and Mats to match and
+// leaving the columns of the seam in seam. False at either end of the log.
+bool seam_log_undo(SeamLog *log, Image *img, int stride, Mat *luminance,
+                   Mat *gradient, int *seam);
+bool seam_log_redo(SeamLog *log, Image *img, int stride, Mat *luminance,
+                   Mat *gradient, int *seam);
+
+#endif // SEAMLOG_H
@@ -0,0 +1,607 @@
+#include "server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "carve.h"
+#include "libseam.h"
+#include "trace.h"
+
+// Buffers kept for connections yet to come, and their total size
+#define POOL_MAX 64
+#define POOL_BYTES ((size_t)1 << 30)
+
+// Pixels held by the requests in flight on one connection
+#define CONNECTION_BYTES \
+  ((size_t)SERVER_MAX_SIDE * SERVER_MAX_SIDE * sizeof(Color))
+
+typedef struct Server Server;
+typedef struct Connection Connection;
+
+typedef struct {
+  Connection *conn;
+  RequestHeader request;
+  ResponseHeader response;
+  // Holds the pixels of the request, carved in place into those of the
+  // answer. Taken from the pool for one request and given back once it is
+  // answered.
+  Arena buffer;
+  Color *pixels;
+  size_t bytes;
+  bool done;
+} Slot;
+
+/*
+A connection is read by its own thread and answered by a second one. The
+reader fills slots in turn and the writer sends them back in the same order
+once a worker is done with them: read - answered requests are in flight.
+*/
+struct Connection {
+  Server *server;
+  int fd;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  Slot slots[SERVER_PIPELINE];
+  long read;
+  long answered;
+  // Pixel bytes of the requests in flight, at most CONNECTION_BYTES unless a
+  // single request needs more
+  size_t bytes;
+  bool closed;
+  bool broken;
+  // Neighbours in the list of open connections
+  Connection *prev;
+  Connection *next;
+};
+
+typedef struct {
+  Server *server;
+  pthread_t thread;
+  SeamCtx *ctx;
+} Worker;
+
+struct Server {
+  int listen_fd;
+  Worker *workers;
+  int threads;
+
+  // Bounded queue of requests waiting for a worker
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  Slot **queue;
+  int depth;
+  long head;
+  long tail;
+  bool stopping;
+
+  Arena pool[POOL_MAX];
+  int pooled;
+  size_t pooled_bytes;
+
+  Connection *open;
+  int open_count;
+  pthread_cond_t closed;
+
+  // Pixel bytes of the requests in flight on every connection, at most
+  // memory unless a single request needs more
+  size_t bytes;
+  size_t memory;
+  pthread_cond_t released;
+
+  atomic_long served;
+  atomic_long connections;
+};
+
+static volatile sig_atomic_t interrupted;
+
+static void on_signal(int sig) {
+  (void)sig;
+  interrupted = 1;
+}
+
+// Threads are started with SIGINT and SIGTERM blocked, so that the signals
+// reach the thread waiting in accept and interrupt it
+static bool spawn(pthread_t *thread, void *(*run)(void *), void *arg) {
+  sigset_t stop, old;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop, &old);
+  bool started = pthread_create(thread, NULL, run, arg) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return started;
+}
+
+static bool recv_all(int fd, void *data, size_t len) {
+  uint8_t *p = data;
+  while (len > 0) {
+    ssize_t n = recv(fd, p, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Reads and drops the pixels of a request that cannot be carved
+static bool recv_skip(int fd, size_t len) {
+  uint8_t scratch[4096];
+  while (len > 0) {
+    size_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+    if (!recv_all(fd, scratch, n)) {
+      return false;
+    }
+    len -= n;
+  }
+  return true;
+}
+
+static bool send_all(int fd, const void *data, size_t len) {
+  const uint8_t *p = data;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// The smallest pooled buffer that fits, or a new one. False if there is no
+// memory left for it.
+static bool pool_take(Server *s, size_t bytes, Arena *arena) {
+  pthread_mutex_lock(&s->lock);
+  int best = -1;
+  for (int i = 0; i < s->pooled; i++) {
+    if (s->pool[i].size >= bytes &&
+        (best < 0 || s->pool[i].size < s->pool[best].size)) {
+      best = i;
+    }
+  }
+  *arena = (Arena){0};
+  if (best >= 0) {
+    *arena = s->pool[best];
+    s->pool[best] = s->pool[--s->pooled];
+    s->pooled_bytes -= arena->size;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if (arena->base == NULL && !arena_try_new(bytes + bytes / 4, arena)) {
+    return false;
+  }
+  arena_reset(arena);
+  return true;
+}
+
+static void pool_give(Server *s, Arena *arena) {
+  if (arena->base == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  bool kept =
+      s->pooled < POOL_MAX && s->pooled_bytes + arena->size <= POOL_BYTES;
+  if (kept) {
+    s->pool[s->pooled++] = *arena;
+    s->pooled_bytes += arena->size;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if (!kept) {
+    arena_destroy(arena);
+  }
+  *arena = (Arena){0};
+}
+
+static void queue_push(Server *s, Slot *slot) {
+  pthread_mutex_lock(&s->lock);
+  while (s->tail - s->head == s->depth) {
+    pthread_cond_wait(&s->not_full, &s->lock);
+  }
+  s->queue[s->tail++ % s->depth] = slot;
+  pthread_cond_signal(&s->not_empty);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Blocks until there is a request, or returns NULL once the server stops
+static Slot *queue_pop(Server *s) {
+  pthread_mutex_lock(&s->lock);
+  while (s->tail == s->head && !s->stopping) {
+    pthread_cond_wait(&s->not_empty, &s->lock);
+  }
+  Slot *slot = NULL;
+  if (s->tail != s->head) {
+    slot = s->queue[s->head++ % s->depth];
+    pthread_cond_signal(&s->not_full);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return slot;
+}
+
+// Answers are packed at the start of the request's buffer
+static void carve_request(Worker *w, Slot *slot) {
+  TRACE_SCOPE("request");
+  SeamImage image = {
+      .pixels = (uint8_t *)slot->pixels,
+      .width = slot->request.width,
+      .height = slot->request.height,
+      .stride = slot->request.width,
+  };
+  seam_ctx_set_beam(w->ctx, slot->request.beam);
+  SeamStatus status = seam_ctx_carve(w->ctx, &image, slot->response.width,
+                                     slot->response.height);
+  seam_ctx_trim(w->ctx, (size_t)SERVER_KEEP_MIB << 20);
+  if (status != SEAM_OK) {
+    // The request was checked as it was read, so only memory can run out
+    slot->response = (ResponseHeader){.magic = SERVER_MAGIC,
+                                      .status = SERVER_FAILED};
+    return;
+  }
+
+  Color *data = slot->pixels;
+  for (int y = 1; y < image.height; y++) {
+    memmove(&data[(size_t)y * image.width], &data[(size_t)y * image.stride],
+            image.width * sizeof(Color));
+  }
+}
+
+static void *worker_run(void *arg) {
+  Worker *w = arg;
+  trace_thread_name("worker");
+  Slot *slot;
+  while ((slot = queue_pop(w->server)) != NULL) {
+    carve_request(w, slot);
+    atomic_fetch_add(&w->server->served, 1);
+
+    Connection *c = slot->conn;
+    pthread_mutex_lock(&c->lock);
+    slot->done = true;
+    pthread_cond_broadcast(&c->changed);
+    pthread_mutex_unlock(&c->lock);
+  }
+  return NULL;
+}
+
+// Waits until the requests in flight on every connection leave room for
+// bytes more, or are all answered
+static void server_hold(Server *s, size_t bytes) {
+  pthread_mutex_lock(&s->lock);
+  while (s->bytes > 0 && s->bytes + bytes > s->memory) {
+    pthread_cond_wait(&s->released, &s->lock);
+  }
+  s->bytes += bytes;
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void server_release(Server *s, size_t bytes) {
+  pthread_mutex_lock(&s->lock);
+  s->bytes -= bytes;
+  pthread_cond_broadcast(&s->released);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void *connection_write(void *arg) {
+  Connection *c = arg;
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    Slot *slot = &c->slots[c->answered % SERVER_PIPELINE];
+    while (!(c->answered < c->read && slot->done) &&
+           !(c->closed && c->answered == c->read)) {
+      pthread_cond_wait(&c->changed, &c->lock);
+    }
+    if (c->answered == c->read) {
+      break;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    // A client that went away still has its requests run to the end, so
+    // that no worker is left holding a slot
+    const ResponseHeader *r = &slot->response;
+    size_t bytes = r->status == SERVER_OK
+                       ? (size_t)r->width * r->height * sizeof(Color)
+                       : 0;
+    if (!c->broken && !(send_all(c->fd, r, sizeof(*r)) &&
+                        send_all(c->fd, slot->pixels, bytes))) {
+      c->broken = true;
+      shutdown(c->fd, SHUT_RDWR);
+    }
+    pool_give(c->server, &slot->buffer);
+    server_release(c->server, slot->bytes);
+
+    pthread_mutex_lock(&c->lock);
+    c->bytes -= slot->bytes;
+    slot->done = false;
+    c->answered++;
+    pthread_cond_broadcast(&c->changed);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+// Reads the pixels of a request whose header is in slot. False if the
+// connection cannot go on.
+static bool read_request(Connection *c, Slot *slot) {
+  const RequestHeader *q = &slot->request;
+  ResponseHeader *r = &slot->response;
+  *r = (ResponseHeader){.magic = SERVER_MAGIC, .status = SERVER_BAD_REQUEST};
+  slot->bytes = 0;
+  if (q->magic != SERVER_MAGIC || q->width == 0 || q->height == 0 ||
+      q->width > SERVER_MAX_SIDE || q->height > SERVER_MAX_SIDE ||
+      q->beam > SERVER_MAX_BEAM) {
+    return false;
+  }
+
+  // Nothing more is read until the requests in flight leave room for this
+  // one, or are all answered
+  size_t pixels = (size_t)q->width * q->height;
+  size_t bytes = pixels * sizeof(Color);
+  pthread_mutex_lock(&c->lock);
+  while (c->read > c->answered && c->bytes + bytes > CONNECTION_BYTES) {
+    pthread_cond_wait(&c->changed, &c->lock);
+  }
+  c->bytes += bytes;
+  slot->bytes = bytes;
+  pthread_mutex_unlock(&c->lock);
+  server_hold(c->server, bytes);
+
+  if (!pool_take(c->server, arena_bytes(pixels, sizeof(Color)),
+                 &slot->buffer)) {
+    r->status = SERVER_FAILED;
+    return recv_skip(c->fd, bytes);
+  }
+  slot->pixels = arena_alloc(&slot->buffer, pixels, sizeof(Color));
+  if (!recv_all(c->fd, slot->pixels, bytes)) {
+    return false;
+  }
+
+  uint32_t tw = q->target_width > 0 ? q->target_width : q->width;
+  uint32_t th = q->target_height > 0 ? q->target_height : q->height;
+  if (tw > q->width || th > q->height) {
+    r->status = SERVER_BAD_TARGET;
+    return true;
+  }
+  r->status = SERVER_OK;
+  r->width = tw;
+  r->height = th;
+  return true;
+}
+
+// Takes c off the list of open connections and closes it. Called under the
+// server's lock, so that a stopping server never shuts down a file descriptor
+// that has since been reused.
+static void connection_close(Server *s, Connection *c) {
+  *(c->prev != NULL ? &c->prev->next : &s->open) = c->next;
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  }
+  s->open_count--;
+  close(c->fd);
+  pthread_cond_signal(&s->closed);
+}
+
+static void connection_free(Connection *c) {
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->changed);
+  free(c);
+}
+
+static void *connection_run(void *arg) {
+  Connection *c = arg;
+  Server *s = c->server;
+  // Without a writer no request could be answered
+  bool writing = spawn(&c->writer, connection_write, c);
+
+  for (bool open = writing; open;) {
+    // Past SERVER_PIPELINE requests in flight nothing more is read, and the
+    // client ends up blocked on a full socket
+    pthread_mutex_lock(&c->lock);
+    while (c->read - c->answered == SERVER_PIPELINE) {
+      pthread_cond_wait(&c->changed, &c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    Slot *slot = &c->slots[c->read % SERVER_PIPELINE];
+    if (!recv_all(c->fd, &slot->request, sizeof(slot->request))) {
+      break;
+    }
+    open = read_request(c, slot);
+
+    bool queued = slot->response.status == SERVER_OK;
+    pthread_mutex_lock(&c->lock);
+    slot->done = !queued;
+    c->read++;
+    pthread_cond_broadcast(&c->changed);
+    pthread_mutex_unlock(&c->lock);
+    if (queued) {
+      queue_push(s, slot);
+    }
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->closed = true;
+  pthread_cond_broadcast(&c->changed);
+  pthread_mutex_unlock(&c->lock);
+  if (writing) {
+    pthread_join(c->writer, NULL);
+  }
+
+  pthread_mutex_lock(&s->lock);
+  connection_close(s, c);
+  pthread_mutex_unlock(&s->lock);
+  connection_free(c);
+  return NULL;
+}
+
+static int listen_on(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  // A socket left behind by an earlier run is replaced, anything else is not
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+bool server_run(const ServerOptions *options) {
+  Server s = {0};
+  s.listen_fd = listen_on(options->socket_path);
+  if (s.listen_fd < 0) {
+    return false;
+  }
+
+  s.threads = options->threads > 0 ? options->threads
+                                   : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  s.depth = options->queue_depth > 0 ? options->queue_depth : 2 * s.threads;
+  s.queue = calloc(s.depth, sizeof(Slot *));
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.not_empty, NULL);
+  pthread_cond_init(&s.not_full, NULL);
+  pthread_cond_init(&s.closed, NULL);
+  pthread_cond_init(&s.released, NULL);
+  s.memory = options->memory > 0 ? options->memory
+                                 : (size_t)SERVER_MEMORY_MIB << 20;
+  s.workers = calloc(s.threads, sizeof(Worker));
+  int started = 0;
+  for (; started < s.threads; started++) {
+    Worker *w = &s.workers[started];
+    w->server = &s;
+    w->ctx = seam_ctx_create(NULL);
+    if (w->ctx == NULL || !spawn(&w->thread, worker_run, w)) {
+      seam_ctx_destroy(w->ctx);
+      break;
+    }
+  }
+  bool ok = started == s.threads;
+  if (!ok) {
+    fprintf(stderr, "Could not start %d worker threads\n", s.threads);
+  }
+
+  // No SA_RESTART, so that accept returns on a signal
+  struct sigaction sa = {.sa_handler = on_signal};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (ok) {
+    fprintf(stderr, "Listening on %s with %d threads\n", options->socket_path,
+            s.threads);
+  }
+  while (ok && !interrupted) {
+    int fd = accept(s.listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+        ok = false;
+        break;
+      }
+      continue;
+    }
+
+    // Only this thread opens connections, so the count can only go down
+    // before the new one is on the list
+    pthread_mutex_lock(&s.lock);
+    bool room = s.open_count < SERVER_MAX_CONNECTIONS;
+    pthread_mutex_unlock(&s.lock);
+    if (!room) {
+      ResponseHeader busy = {.magic = SERVER_MAGIC, .status = SERVER_BUSY};
+      send_all(fd, &busy, sizeof(busy));
+      close(fd);
+      continue;
+    }
+
+    Connection *c = calloc(1, sizeof(Connection));
+    c->server = &s;
+    c->fd = fd;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->changed, NULL);
+    for (int i = 0; i < SERVER_PIPELINE; i++) {
+      c->slots[i].conn = c;
+    }
+    atomic_fetch_add(&s.connections, 1);
+
+    pthread_mutex_lock(&s.lock);
+    c->next = s.open;
+    if (s.open != NULL) {
+      s.open->prev = c;
+    }
+    s.open = c;
+    s.open_count++;
+    pthread_mutex_unlock(&s.lock);
+
+    pthread_t thread;
+    if (spawn(&thread, connection_run, c)) {
+      pthread_detach(thread);
+    } else {
+      pthread_mutex_lock(&s.lock);
+      connection_close(&s, c);
+      pthread_mutex_unlock(&s.lock);
+      connection_free(c);
+    }
+  }
+
+  close(s.listen_fd);
+  unlink(options->socket_path);
+
+  // Requests already read are carved and answered, as far as the clients
+  // are still there to take them, before the workers stop
+  pthread_mutex_lock(&s.lock);
+  for (Connection *c = s.open; c != NULL; c = c->next) {
+    shutdown(c->fd, SHUT_RD);
+  }
+  while (s.open != NULL) {
+    pthread_cond_wait(&s.closed, &s.lock);
+  }
+  s.stopping = true;
+  pthread_cond_broadcast(&s.not_empty);
+  pthread_mutex_unlock(&s.lock);
+
+  for (int t = 0; t < started; t++) {
+    pthread_join(s.workers[t].thread, NULL);
+    seam_ctx_destroy(s.workers[t].ctx);
+  }
+  for (int i = 0; i < s.pooled; i++) {
+    arena_destroy(&s.pool[i]);
+  }
+  free(s.workers);
+  free(s.queue);
+
+  fprintf(stderr, "Served %ld requests over %ld connections\n",
+          atomic_load(&s.served), atomic_load(&s.connections));
+  return ok;
+}
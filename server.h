@@ -0,0 +1,80 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Carves images sent over a Unix domain socket by a long-running process. The
+worker threads and their arenas, and the pixel buffers requests are read
+into, are set up once and reused from one request to the next.
+
+A client may send any number of requests without waiting for the answers,
+which come back in the same order on the same connection. Each connection
+has at most SERVER_PIPELINE requests in flight, holding together no more
+pixels than one image SERVER_MAX_SIDE on each side. The server as a whole
+holds at most memory bytes of pixels in flight, SERVER_MEMORY_MIB MiB unless
+set, and has at most queue_depth requests waiting for a worker. A single
+request larger than either byte limit is read once nothing else is in flight.
+Past any of these limits the server stops reading from the socket until a
+request is answered, and the client's writes block once the socket buffer is
+full. A worker keeps the working memory of its last request for the next
+only up to SERVER_KEEP_MIB MiB. Past SERVER_MAX_CONNECTIONS
+open connections a new one is answered SERVER_BUSY and closed at once.
+
+Every field is in the byte order of the host. A request is a RequestHeader
+followed by width * height RGBA pixels, row after row. The answer is a
+ResponseHeader followed, if status is SERVER_OK, by the carved pixels in the
+same layout. A target of zero keeps that dimension as it is. A beam of zero
+finds the best seams; any other width, up to SERVER_MAX_BEAM, trades them
+for speed as seam_ctx_set_beam describes.
+*/
+
+#define SERVER_MAGIC 0x4d414553 // "SEAM"
+#define SERVER_PIPELINE 8
+#define SERVER_MAX_SIDE 16384
+#define SERVER_MAX_BEAM 1024
+#define SERVER_MAX_CONNECTIONS 64
+#define SERVER_MEMORY_MIB 4096
+#define SERVER_KEEP_MIB 256
+
+typedef struct {
+  uint32_t magic;
+  uint32_t width;
+  uint32_t height;
+  uint32_t target_width;
+  uint32_t target_height;
+  uint32_t beam;
+} RequestHeader;
+
+typedef enum {
+  SERVER_OK,
+  // Not a request, or an image too large: the connection is closed after
+  // the answer
+  SERVER_BAD_REQUEST,
+  SERVER_BAD_TARGET,
+  // Out of memory for this request, the connection goes on
+  SERVER_FAILED,
+  // Sent without a request when too many connections are open
+  SERVER_BUSY,
+} ServerStatus;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t status;
+  uint32_t width;
+  uint32_t height;
+} ResponseHeader;
+
+typedef struct {
+  const char *socket_path;
+  int threads;
+  int queue_depth;
+  // Bytes of pixels in flight over all connections, zero for the default
+  size_t memory;
+} ServerOptions;
+
+bool server_run(const ServerOptions *options);
+
+#endif // SERVER_H
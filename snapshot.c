@@ -0,0 +1,106 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <time.h>
+
+void snapshot_buffer_init(SnapshotBuffer *buffer, Snapshot snapshots[3]) {
+  for (int i = 0; i < 3; i++) {
+    buffer->buffers[i] = snapshots[i];
+  }
+  buffer->back = 0;
+  atomic_init(&buffer->middle, 1);
+  buffer->front = 2;
+  buffer->published_x0 = 0;
+}
+
+Snapshot *snapshot_back(SnapshotBuffer *buffer) {
+  return &buffer->buffers[buffer->back];
+}
+
+/*
+Hands the back buffer over to the reader. If the reader has not picked up the
+previous snapshot yet, this one replaces it and has to carry its dirty
+columns too. The check can race with the reader taking the previous one, in
+which case a few columns get uploaded twice.
+*/
+void snapshot_publish(SnapshotBuffer *buffer) {
+  Snapshot *back = &buffer->buffers[buffer->back];
+  int middle = atomic_load_explicit(&buffer->middle, memory_order_relaxed);
+  if ((middle & SNAPSHOT_FRESH) && buffer->published_x0 < back->x0) {
+    back->x0 = buffer->published_x0;
+  }
+  buffer->published_x0 = back->x0;
+
+  middle = atomic_exchange_explicit(
+      &buffer->middle, buffer->back | SNAPSHOT_FRESH, memory_order_acq_rel);
+  buffer->back = middle & ~SNAPSHOT_FRESH;
+}
+
+// Returns true and the newest snapshot if one was published since the last
+// call; otherwise the snapshot already held is left in place.
+bool snapshot_acquire(SnapshotBuffer *buffer, Snapshot **snapshot) {
+  *snapshot = &buffer->buffers[buffer->front];
+  int middle = atomic_load_explicit(&buffer->middle, memory_order_relaxed);
+  if (!(middle & SNAPSHOT_FRESH)) {
+    return false;
+  }
+
+  middle = atomic_exchange_explicit(&buffer->middle, buffer->front,
+                                    memory_order_acq_rel);
+  buffer->front = middle & ~SNAPSHOT_FRESH;
+  *snapshot = &buffer->buffers[buffer->front];
+  return true;
+}
+
+void command_queue_init(CommandQueue *queue) {
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  sem_init(&queue->pending, 0, 0);
+}
+
+void command_queue_destroy(CommandQueue *queue) { sem_destroy(&queue->pending); }
+
+// Drops the command and returns false when the ring is full
+bool command_push(CommandQueue *queue, Command command) {
+  unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (tail - head == COMMAND_QUEUE_SIZE) {
+    return false;
+  }
+
+  queue->ring[tail % COMMAND_QUEUE_SIZE] = command;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  sem_post(&queue->pending);
+  return true;
+}
+
+/*
+Pops the next command, waiting for up to timeout seconds for one to arrive.
+A timeout of zero only polls and a negative one waits indefinitely.
+*/
+bool command_pop(CommandQueue *queue, Command *command, double timeout) {
+  int rc;
+  if (timeout == 0) {
+    rc = sem_trywait(&queue->pending);
+  } else if (timeout < 0) {
+    while ((rc = sem_wait(&queue->pending)) != 0 && errno == EINTR) {
+    }
+  } else {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long ns = deadline.tv_nsec + (long long)(timeout * 1e9);
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+    while ((rc = sem_timedwait(&queue->pending, &deadline)) != 0 &&
+           errno == EINTR) {
+    }
+  }
+  if (rc != 0) {
+    return false;
+  }
+
+  unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  *command = queue->ring[head % COMMAND_QUEUE_SIZE];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
@@ -0,0 +1,78 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <raylib.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/*
+Plumbing between the carving worker and the render loop, neither side ever
+taking a lock.
+
+Snapshots go through a triple buffer: the worker fills its back buffer and
+swaps it with the middle one, the render loop swaps its front buffer with the
+middle one whenever a fresh snapshot is waiting. Each side always owns one
+buffer outright, so the worker never waits for a frame and the render loop
+never sees a half-written image.
+
+Commands go the other way through a single-producer single-consumer ring.
+A semaphore counts the queued commands so that an idle worker can sleep
+until the next one instead of polling.
+*/
+
+typedef struct {
+  Image img;
+  int stride;
+  // Leftmost column that may differ from the previous snapshot the reader
+  // took; everything from there to the right edge has to be uploaded again.
+  int x0;
+  int seams_removed;
+  int target_width;
+  int target_height;
+} Snapshot;
+
+#define SNAPSHOT_FRESH 4
+
+typedef struct {
+  Snapshot buffers[3];
+  atomic_int middle;
+  int back;
+  int front;
+  int published_x0;
+} SnapshotBuffer;
+
+void snapshot_buffer_init(SnapshotBuffer *buffer, Snapshot snapshots[3]);
+Snapshot *snapshot_back(SnapshotBuffer *buffer);
+void snapshot_publish(SnapshotBuffer *buffer);
+bool snapshot_acquire(SnapshotBuffer *buffer, Snapshot **snapshot);
+
+#define COMMAND_QUEUE_SIZE 64
+
+typedef enum {
+  CMD_RESET,
+  CMD_CARVE,
+  CMD_PAUSE,
+  CMD_FASTER,
+  CMD_SLOWER,
+  CMD_BUDGET,
+  CMD_UNDO,
+  CMD_REDO,
+  CMD_TARGET,
+  CMD_SAVE,
+  CMD_QUIT,
+} Command;
+
+typedef struct {
+  Command ring[COMMAND_QUEUE_SIZE];
+  atomic_uint head;
+  atomic_uint tail;
+  sem_t pending;
+} CommandQueue;
+
+void command_queue_init(CommandQueue *queue);
+void command_queue_destroy(CommandQueue *queue);
+bool command_push(CommandQueue *queue, Command command);
+bool command_pop(CommandQueue *queue, Command *command, double timeout);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,347 @@
+#include "strips.h"
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+typedef struct {
+  // The strip's columns of the image, carved in place, from column x on
+  Image img;
+  int stride;
+  int x;
+  int seams;
+  // The strip's own copy of its columns of the whole gradient, or the whole
+  // gradient itself when the strip is the whole image
+  Mat whole;
+  Mat gradient;
+  Mat dp;
+  int *seam;
+} Strip;
+
+typedef struct {
+  float cost;
+  int x;
+} Column;
+
+typedef struct {
+  StripPool *pool;
+  pthread_t thread;
+  // Strip carved in every pass with more than index strips
+  int index;
+} StripWorker;
+
+struct StripPool {
+  pthread_mutex_t lock;
+  pthread_cond_t started;
+  pthread_cond_t finished;
+  // Threads besides the caller's, which carves the first strip itself
+  StripWorker *workers;
+  int threads;
+  // The pass under way: its strips, and how many of those past the first
+  // are done
+  Strip *strips;
+  int count;
+  int done;
+  long pass;
+  bool stopping;
+};
+
+
+static int strip_count(int w, int strips) {
+  int most = w / STRIPS_MIN_WIDTH;
+  strips = strips < most ? strips : most;
+  return strips > 1 ? strips : 1;
+}
+
+// The strips take the gradient and DP of the whole image between them, and
+// a padded row start more each
+size_t strips_bytes(int w, int h, int strips) {
+  strips = strip_count(w, strips);
+  int padding = strips > 1 ? strips * (2 * MAT_ALIGN + 1) : 0;
+  return arena_bytes(strips, sizeof(Strip)) + arena_bytes(w + 1, sizeof(int)) +
+         arena_bytes(w + 1, sizeof(double)) +
+         (strips > 1 ? arena_bytes(w, sizeof(float)) +
+                           arena_bytes(w, sizeof(Column))
+                     : 0) +
+         (strips > 1 ? 2 : 1) * mat_bytes(w + padding, h) +
+         strips * (arena_bytes(h, sizeof(int)) + 2 * ARENA_ALIGN);
+}
+
+static void strip_carve(Strip *s) {
+  TRACE_SCOPE("strip");
+  int h = s->img.height;
+  if (s->gradient.data != s->whole.data) {
+    for (int y = 0; y < h; y++) {
+      memcpy(MAT_ROW(s->gradient, y),
+             &MAT_AT(s->whole, y, s->x, s->whole.stride),
+             s->gradient.width * sizeof(float));
+    }
+  }
+
+  for (; s->seams > 0; s->seams--) {
+    {
+      TRACE_SCOPE("gradient_to_dp");
+      gradient_to_dp(s->gradient, s->dp);
+    }
+    {
+      TRACE_SCOPE("compute_seam");
+      compute_seam(s->dp, s->seam);
+    }
+    TRACE_SCOPE("remove_seam");
+    for (int y = 0; y < h; y++) {
+      img_remove_column_at_row(s->img, y, s->seam[y], s->stride);
+      mat_remove_column_at_row(s->gradient, y, s->seam[y]);
+    }
+    s->img.width--;
+    s->gradient.width--;
+    s->dp.width--;
+  }
+}
+
+static int by_cost(const void *a, const void *b) {
+  float x = ((const Column *)a)->cost;
+  float y = ((const Column *)b)->cost;
+  return (x > y) - (x < y);
+}
+
+/*
+Spreads the seams over the columns: share[x] is how many of them the
+columns left of x take. Most of every seam is put down on one of the columns
+of least energy from top to bottom, so that the busy parts of the image are
+left alone, and STRIPS_EVEN of it evenly over the width, so that no strip
+has to give up so many of its columns that its seams all go straight.
+*/
+static void share_seams(Arena *arena, Mat gradient, int seams, double *share) {
+  int w = gradient.width;
+  float *sum = arena_alloc(arena, w, sizeof(float));
+  memcpy(sum, MAT_ROW(gradient, 0), w * sizeof(float));
+  for (int y = 1; y < gradient.height; y++) {
+    const float *row = MAT_ROW(gradient, y);
+    for (int x = 0; x < w; x++) {
+      sum[x] += row[x];
+    }
+  }
+
+  Column *columns = arena_alloc(arena, w, sizeof(Column));
+  for (int x = 0; x < w; x++) {
+    columns[x] = (Column){sum[x], x};
+    share[x + 1] = STRIPS_EVEN * seams / w;
+  }
+  qsort(columns, w, sizeof(Column), by_cost);
+  for (int i = 0; i < seams; i++) {
+    share[columns[i].x + 1] += 1 - STRIPS_EVEN;
+  }
+  share[0] = 0;
+  for (int x = 0; x < w; x++) {
+    share[x + 1] += share[x];
+  }
+}
+
+static void *strip_run(void *arg) {
+  StripWorker *w = arg;
+  StripPool *p = w->pool;
+  trace_thread_name("strip");
+  long seen = 0;
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (p->pass == seen && !p->stopping) {
+      pthread_cond_wait(&p->started, &p->lock);
+    }
+    if (p->stopping) {
+      break;
+    }
+    seen = p->pass;
+    if (w->index < p->count) {
+      Strip *s = &p->strips[w->index];
+      pthread_mutex_unlock(&p->lock);
+      strip_carve(s);
+      pthread_mutex_lock(&p->lock);
+      if (++p->done == p->count - 1) {
+        pthread_cond_signal(&p->finished);
+      }
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+StripPool *strip_pool_new(int strips) {
+  StripPool *p = calloc(1, sizeof(StripPool));
+  if (p == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->started, NULL);
+  pthread_cond_init(&p->finished, NULL);
+  p->workers = calloc(strips > 1 ? strips - 1 : 1, sizeof(StripWorker));
+  for (; p->workers != NULL && p->threads < strips - 1; p->threads++) {
+    StripWorker *w = &p->workers[p->threads];
+    w->pool = p;
+    w->index = p->threads + 1;
+    if (pthread_create(&w->thread, NULL, strip_run, w) != 0) {
+      break;
+    }
+  }
+  return p;
+}
+
+void strip_pool_destroy(StripPool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->started);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->threads; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->started);
+  pthread_cond_destroy(&pool->finished);
+  free(pool->workers);
+  free(pool);
+}
+
+// The first strip on the calling thread, the others on the pool's
+static void run_strips(StripPool *p, Strip *strips, int n) {
+  if (n > 1) {
+    pthread_mutex_lock(&p->lock);
+    p->strips = strips;
+    p->count = n;
+    p->done = 0;
+    p->pass++;
+    pthread_cond_broadcast(&p->started);
+    pthread_mutex_unlock(&p->lock);
+  }
+  strip_carve(&strips[0]);
+  if (n > 1) {
+    pthread_mutex_lock(&p->lock);
+    while (p->done < n - 1) {
+      pthread_cond_wait(&p->finished, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+// Cuts the columns into strips of work, share of the seams times width, up
+// to limit from left to right, and returns how many it takes
+static int cut_strips(const double *share, int w, double limit, int *edges) {
+  int n = 0;
+  edges[0] = 0;
+  for (int x = 1; x < w; x++) {
+    if ((share[x + 1] - share[edges[n]]) * (x + 1 - edges[n]) > limit) {
+      edges[++n] = x;
+    }
+  }
+  edges[++n] = w;
+  return n;
+}
+
+/*
+Removes seams from img in up to count strips. Every strip takes the share of
+the seams whose columns fall in it, as long as it keeps a column; what it
+cannot take is left for later. The edges are placed for every strip to have
+about as much work as the others, so that the strips finish together: where
+the seams crowd, the strips are narrow.
+*/
+static void carve_pass(StripPool *pool, Arena *arena, Strip *strips,
+                       int count, Image *img, int stride, Mat *gradient,
+                       int seams) {
+  int w = img->width;
+  int h = img->height;
+  assert(seams < w);
+  size_t mark = arena_mark(arena);
+  int *edges = arena_alloc(arena, w + 1, sizeof(int));
+  double *share = arena_alloc(arena, w + 1, sizeof(double));
+  int n = 1;
+  edges[0] = 0;
+  edges[1] = w;
+  if (count > 1) {
+    size_t columns = arena_mark(arena);
+    share_seams(arena, *gradient, seams, share);
+    arena_rewind(arena, columns);
+
+    // The least work per strip that cuts the columns in count strips, to
+    // within a column's worth
+    double lo = 0;
+    double hi = (double)seams * w;
+    while (hi - lo > seams) {
+      double mid = (lo + hi) / 2;
+      if (cut_strips(share, w, mid, edges) <= count) {
+        hi = mid;
+      } else {
+        lo = mid;
+      }
+    }
+    n = cut_strips(share, w, hi, edges);
+  }
+
+  int removed = 0;
+  for (int i = 0; i < n; i++) {
+    Strip *s = &strips[i];
+    int sw = edges[i + 1] - edges[i];
+    // Rounded the same way at both edges, so the shares add up to seams
+    int take = n > 1 ? lround(share[edges[i + 1]]) - lround(share[edges[i]])
+                     : seams;
+    *s = (Strip){
+        .img = *img,
+        .stride = stride,
+        .x = edges[i],
+        .seams = take < sw ? take : sw - 1,
+        .whole = *gradient,
+        .gradient = n > 1 ? mat_alloc(arena, sw, h, 0.0f) : *gradient,
+        .dp = mat_alloc(arena, sw, h, FLT_MAX),
+        .seam = arena_alloc(arena, h, sizeof(int)),
+    };
+    s->img.data = (Color *)img->data + edges[i];
+    s->img.width = sw;
+    removed += s->seams;
+  }
+
+  run_strips(pool, strips, n);
+
+  // Left to right, every strip moves to where the one before it ends, which
+  // is never to the right of where it starts
+  TRACE_SCOPE("stitch");
+  Color *pixels = img->data;
+  for (int y = 0; y < h && n > 1; y++) {
+    float ghost = MAT_AT(*gradient, y, w, gradient->stride);
+    int x = 0;
+    for (int i = 0; i < n; i++) {
+      const Strip *s = &strips[i];
+      memmove(&pixels[y * stride + x], &pixels[y * stride + s->x],
+              s->img.width * sizeof(Color));
+      memcpy(&MAT_AT(*gradient, y, x, gradient->stride),
+             MAT_ROW(s->gradient, y), s->img.width * sizeof(float));
+      x += s->img.width;
+    }
+    MAT_AT(*gradient, y, x, gradient->stride) = ghost;
+  }
+  img->width -= removed;
+  gradient->width -= removed;
+  arena_rewind(arena, mark);
+}
+
+Image strips_carve(StripPool *pool, Arena *arena, Image img, int stride,
+                   Mat *gradient, int target) {
+  int count = strip_count(img.width, pool != NULL ? pool->threads + 1 : 1);
+  Strip *s = arena_alloc(arena, count, sizeof(Strip));
+  int seams = img.width - target;
+  for (int pass = 0; pass < STRIPS_PASSES && count > 1; pass++) {
+    int share =
+        seams * (pass + 1) / STRIPS_PASSES - seams * pass / STRIPS_PASSES;
+    carve_pass(pool, arena, s, count, &img, stride, gradient, share);
+  }
+  // Whatever the strips could not take, and everything when there is only
+  // one, is carved over the whole width
+  if (img.width > target) {
+    carve_pass(pool, arena, s, 1, &img, stride, gradient, img.width - target);
+  }
+  return img;
+}
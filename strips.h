@@ -0,0 +1,48 @@
+#ifndef STRIPS_H
+#define STRIPS_H
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "carve.h"
+
+/*
+Carving of wide images on several cores at once. The DP of a seam runs one
+row after the other and does not split well between threads, so the image
+is cut into vertical strips instead, and every strip is carved by a thread
+of its own, independently of the others, by its share of the seams. The
+strips are stitched back together once all of them are done.
+
+A seam cannot cross from one strip into the next, which is what it costs in
+quality. The seams are shared out by where the energy is low, and the edges
+placed for every strip to have as much work as the others, so quiet parts
+of the image are cut in narrow strips. The seams are removed in
+STRIPS_PASSES passes, each cut afresh, so that no edge walls seams off for
+the whole carve. The gradient is taken over the whole image, so the strips
+overlap by the Sobel kernel and see their neighbours' pixels at their edges.
+
+The threads are those of a StripPool, started once and kept waiting between
+passes and from one image to the next.
+*/
+#define STRIPS_PASSES 2
+// Narrowest strip worth a thread of its own, before the edges are placed
+#define STRIPS_MIN_WIDTH 64
+// Fraction of the seams shared out evenly over the width
+#define STRIPS_EVEN 0.25
+
+typedef struct StripPool StripPool;
+
+// Threads for up to strips strips, the caller's own included, or fewer if
+// the system will not start them all. NULL if out of memory.
+StripPool *strip_pool_new(int strips);
+void strip_pool_destroy(StripPool *pool);
+
+size_t strips_bytes(int w, int h, int strips);
+
+// Carves img, whose rows are stride pixels apart, down to target columns in
+// as many strips as pool has threads for. gradient is its energy and is
+// carved along with it, its width included.
+Image strips_carve(StripPool *pool, Arena *arena, Image img, int stride,
+                   Mat *gradient, int target);
+
+#endif // STRIPS_H
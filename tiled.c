@@ -0,0 +1,306 @@
+#include "tiled.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "carve.h"
+#include "rawio.h"
+#include "trace.h"
+
+typedef struct {
+  Arena arena;
+  int width;
+  int height;
+  int rows;
+
+  // One strip of pixel rows and the backpointers of the same rows
+  Color *strip;
+  int8_t *trace;
+  int trace_fd;
+
+  // Rolling window: three luminance rows for Sobel, one energy row and the
+  // previous and current DP rows
+  float *zero;
+  float *ring[3];
+  float *energy;
+  float *dp[2];
+
+  int *seam;
+  bool pending;
+} Tiler;
+
+// A row with room for the ghost column on each side
+static float *line_alloc(Arena *arena, int width) {
+  float *base = arena_alloc(arena, mat_stride(width), sizeof(float));
+  memset(base, 0, mat_stride(width) * sizeof(float));
+  return base + MAT_ALIGN;
+}
+
+static size_t line_bytes(int width) {
+  return arena_bytes(mat_stride(width), sizeof(float));
+}
+
+static int temp_file() {
+  const char *dir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/seam-XXXXXX", dir != NULL ? dir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+  return fd;
+}
+
+static bool pwrite_all(int fd, const void *data, size_t len, off_t offset) {
+  const uint8_t *p = data;
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// Drops the pending seam from a row of the strip and packs it at its new,
+// narrower position.
+static void strip_remove_seam(Tiler *t, int i, int x) {
+  int w = t->width;
+  Color *src = &t->strip[(size_t)i * w];
+  Color *dst = &t->strip[(size_t)i * (w - 1)];
+  memmove(dst, src, x * sizeof(Color));
+  memmove(dst + x, src + x + 1, (w - x - 1) * sizeof(Color));
+}
+
+// Energy and DP of row y, once the luminance of the row below is known
+static bool tiled_dp_row(Tiler *t, int y, int w, const float *above,
+                         const float *row, const float *below, int *trace_y0) {
+  sobel_row(above, row, below, t->energy, w);
+
+  float *prev = t->dp[(y + 1) % 2];
+  float *cur = t->dp[y % 2];
+  if (y == 0) {
+    // First row is a given
+    memcpy(cur, t->energy, w * sizeof(float));
+    return true;
+  }
+
+  int i = y - *trace_y0;
+  if (i == t->rows) {
+    off_t offset = (off_t)*trace_y0 * w;
+    if (!pwrite_all(t->trace_fd, t->trace, (size_t)t->rows * w, offset)) {
+      return false;
+    }
+    *trace_y0 = y;
+    i = 0;
+  }
+  dp_row_trace(prev, t->energy, cur, &t->trace[(size_t)i * w], w);
+  return true;
+}
+
+/*
+Follows the backpointers up from the cheapest end of the last DP row. Rows
+still in the trace strip are read from memory, the others one byte at a time
+from the spill file: a seam needs a single entry per row.
+*/
+static bool tiled_backtrack(Tiler *t, int w, int trace_y0) {
+  const float *last = t->dp[(t->height - 1) % 2];
+  int *seam = t->seam;
+  int y = t->height - 1;
+  seam[y] = 0;
+  for (int x = 1; x < w; x++) {
+    if (last[x] < last[seam[y]]) {
+      seam[y] = x;
+    }
+  }
+
+  for (; y > 0; y--) {
+    int8_t step;
+    if (y >= trace_y0) {
+      step = t->trace[(size_t)(y - trace_y0) * w + seam[y]];
+    } else {
+      off_t offset = (off_t)y * w + seam[y];
+      if (pread(t->trace_fd, &step, 1, offset) != 1) {
+        return false;
+      }
+    }
+    seam[y - 1] = seam[y] + step;
+  }
+  return true;
+}
+
+/*
+One streaming pass over the image in src: the pending seam is dropped from
+every row, the carved rows go to out, and with find set the DP runs over
+them and leaves the next seam pending.
+*/
+static bool tiled_pass(Tiler *t, int src_fd, const RawImage *layout,
+                       RawWriter *out, bool find) {
+  TRACE_SCOPE(find ? "tiled_pass" : "tiled_write");
+  int w = t->pending ? t->width - 1 : t->width;
+  t->dp[0][-1] = t->dp[0][w] = FLT_MAX;
+  t->dp[1][-1] = t->dp[1][w] = FLT_MAX;
+
+  const float *above = t->zero;
+  const float *row = NULL;
+  int trace_y0 = 1;
+
+  for (int y0 = 0; y0 < t->height; y0 += t->rows) {
+    int count = t->height - y0 < t->rows ? t->height - y0 : t->rows;
+    if (!raw_image_read_rows(src_fd, layout, y0, count, t->strip)) {
+      return false;
+    }
+
+    if (t->pending) {
+      for (int i = 0; i < count; i++) {
+        strip_remove_seam(t, i, t->seam[y0 + i]);
+      }
+    }
+
+    if (out != NULL && !raw_writer_rows(out, t->strip, count, w)) {
+      return false;
+    }
+
+    for (int i = 0; find && i < count; i++) {
+      int y = y0 + i;
+      float *below = t->ring[y % 3];
+      luminance_row(&t->strip[(size_t)i * w], below, w);
+      below[w] = 0.0f;
+      if (row != NULL &&
+          !tiled_dp_row(t, y - 1, w, above, row, below, &trace_y0)) {
+        return false;
+      }
+      above = row != NULL ? row : above;
+      row = below;
+    }
+  }
+
+  if (find) {
+    if (!tiled_dp_row(t, t->height - 1, w, above, row, t->zero, &trace_y0) ||
+        !tiled_backtrack(t, w, trace_y0)) {
+      return false;
+    }
+  }
+
+  t->width = w;
+  t->pending = find;
+  return true;
+}
+
+bool tiled_carve(const TiledOptions *options) {
+  RawImage src;
+  if (!raw_image_probe(options->input, options->raw_width,
+                       options->raw_height, &src)) {
+    fprintf(stderr, "%s: tiled mode needs a PAM, PPM or raw RGBA input\n",
+            options->input);
+    return false;
+  }
+
+  int width = src.width;
+  int height = src.height;
+  // Half the width by default, as in the viewer
+  int target = options->target_width > 0 ? options->target_width : width / 2;
+  if (target <= 0 || target > width) {
+    fprintf(stderr, "Target width must be between 1 and %d\n", width);
+    return false;
+  }
+
+  // Everything but the strips is a few rows wide, or one int per row
+  size_t fixed = 2 * arena_bytes(height, sizeof(int)) + 7 * line_bytes(width);
+  size_t per_row = (size_t)width * (sizeof(Color) + sizeof(int8_t));
+  size_t slack = 2 * ARENA_ALIGN;
+  if (options->budget < fixed + slack + per_row) {
+    fprintf(stderr, "A budget of %zu bytes is too small, %d wide rows need %zu\n",
+            options->budget, width, fixed + slack + per_row);
+    return false;
+  }
+
+  Tiler t = {0};
+  t.width = width;
+  t.height = height;
+  size_t rows = (options->budget - fixed - slack) / per_row;
+  t.rows = rows < (size_t)height ? (int)rows : height;
+  t.arena = arena_new(fixed + slack + (size_t)t.rows * per_row);
+  t.strip = arena_alloc(&t.arena, (size_t)t.rows * width, sizeof(Color));
+  t.trace = arena_alloc(&t.arena, (size_t)t.rows * width, sizeof(int8_t));
+  t.zero = line_alloc(&t.arena, width);
+  for (int i = 0; i < 3; i++) {
+    t.ring[i] = line_alloc(&t.arena, width);
+  }
+  t.energy = line_alloc(&t.arena, width);
+  t.dp[0] = line_alloc(&t.arena, width);
+  t.dp[1] = line_alloc(&t.arena, width);
+  t.seam = arena_alloc(&t.arena, height, sizeof(int));
+
+  int src_fd = open(options->input, O_RDONLY);
+  int temp[2] = {temp_file(), temp_file()};
+  t.trace_fd = temp_file();
+  bool ok = src_fd >= 0 && temp[0] >= 0 && temp[1] >= 0 && t.trace_fd >= 0;
+  if (!ok) {
+    fprintf(stderr, "Could not open %s or a temporary file\n", options->input);
+  }
+
+  // Carved images are kept as packed RGBA in two temporary files used in
+  // turn: each pass reads one and writes the other.
+  int cur_fd = src_fd;
+  RawImage layout = src;
+  int next = 0;
+  int seams = width - target;
+  for (int s = 0; ok && s < seams; s++) {
+    RawWriter dst = {0};
+    bool write = t.pending;
+    if (write) {
+      ok = ftruncate(temp[next], 0) == 0 &&
+           lseek(temp[next], 0, SEEK_SET) == 0;
+      raw_writer_fd(&dst, temp[next], t.width - 1);
+    }
+
+    ok = ok && tiled_pass(&t, cur_fd, &layout, write ? &dst : NULL, true);
+    if (write) {
+      cur_fd = temp[next];
+      layout = (RawImage){.format = RAW_RGBA,
+                          .width = t.width,
+                          .height = height,
+                          .depth = 4};
+      next ^= 1;
+    }
+  }
+
+  RawWriter out = {0};
+  if (ok) {
+    ok = raw_writer_open(&out, options->output, target, height);
+    ok = ok && tiled_pass(&t, cur_fd, &layout, &out, false);
+    ok = raw_writer_close(&out) && ok;
+    if (!ok) {
+      fprintf(stderr, "Could not write %s\n", options->output);
+    }
+  }
+
+  if (ok) {
+    fprintf(stderr,
+            "Removed %d seams in %d passes, %d rows per strip, %zu bytes of "
+            "working memory\n",
+            seams, seams + 1, t.rows, t.arena.size);
+  }
+
+  close(src_fd);
+  close(temp[0]);
+  close(temp[1]);
+  close(t.trace_fd);
+  arena_destroy(&t.arena);
+  return ok;
+}
@@ -0,0 +1,25 @@
+#ifndef TILED_H
+#define TILED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+Out-of-core carving for images that do not fit in memory. The image is
+streamed from disk in strips of rows, one pass per seam; only a handful of
+rows of luminance, energy and DP are ever resident, and the DP backpointers
+are spilled to a temporary file. Every buffer comes from one arena that is
+sized to stay within the budget.
+*/
+typedef struct {
+  const char *input;
+  const char *output;
+  int raw_width;
+  int raw_height;
+  int target_width;
+  size_t budget;
+} TiledOptions;
+
+bool tiled_carve(const TiledOptions *options);
+
+#endif // TILED_H
@@ -0,0 +1,145 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char *name;
+  uint64_t start;
+  uint64_t end;
+} TraceEvent;
+
+typedef struct TraceRing TraceRing;
+
+struct TraceRing {
+  TraceRing *next;
+  // Next ring left by a thread that exited
+  TraceRing *next_idle;
+  int tid;
+  char name[32];
+  // Events ever recorded: the last TRACE_EVENTS of them are in events
+  atomic_ulong recorded;
+  TraceEvent events[TRACE_EVENTS];
+};
+
+bool trace_enabled;
+
+static const char *trace_path;
+static uint64_t trace_origin;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing *rings;
+static TraceRing *idle_rings;
+static int thread_count;
+static pthread_key_t ring_key;
+static _Thread_local TraceRing *ring;
+
+// Run as a thread exits: its events stay in the ring for the trace, and the
+// next thread to start records after them
+static void trace_ring_release(void *arg) {
+  TraceRing *r = arg;
+  pthread_mutex_lock(&rings_lock);
+  r->next_idle = idle_rings;
+  idle_rings = r;
+  pthread_mutex_unlock(&rings_lock);
+  ring = NULL;
+}
+
+/*
+A thread takes a ring on its first event, one left by a thread that exited if
+there is one, so that threads started over and over, as those of the strips
+and the server are, keep no more rings than run at once.
+*/
+static TraceRing *trace_ring() {
+  if (ring == NULL) {
+    pthread_mutex_lock(&rings_lock);
+    ring = idle_rings;
+    if (ring != NULL) {
+      idle_rings = ring->next_idle;
+    } else if ((ring = calloc(1, sizeof(TraceRing))) != NULL) {
+      ring->tid = ++thread_count;
+      ring->next = rings;
+      rings = ring;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if (ring != NULL) {
+      pthread_setspecific(ring_key, ring);
+    }
+  }
+  return ring;
+}
+
+void trace_record(const char *name, uint64_t start, uint64_t end) {
+  TraceRing *r = trace_ring();
+  if (r == NULL) {
+    return;
+  }
+  unsigned long i = atomic_load_explicit(&r->recorded, memory_order_relaxed);
+  r->events[i % TRACE_EVENTS] = (TraceEvent){name, start, end};
+  atomic_store_explicit(&r->recorded, i + 1, memory_order_release);
+}
+
+void trace_thread_name(const char *name) {
+  TraceRing *r = trace_enabled ? trace_ring() : NULL;
+  if (r != NULL) {
+    snprintf(r->name, sizeof(r->name), "%s", name);
+  }
+}
+
+static double trace_us(uint64_t ns) { return (ns - trace_origin) / 1e3; }
+
+/*
+Written at exit. Threads still running may add events meanwhile; those
+recorded after their ring is read are left out.
+*/
+static void trace_flush() {
+  FILE *out = fopen(trace_path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not write the trace to %s\n", trace_path);
+    return;
+  }
+
+  fprintf(out, "{\"traceEvents\": [\n");
+  bool first = true;
+  pthread_mutex_lock(&rings_lock);
+  for (TraceRing *r = rings; r != NULL; r = r->next) {
+    if (r->name[0] != '\0') {
+      fprintf(out,
+              "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+              "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+              first ? "" : ",\n", r->tid, r->name);
+      first = false;
+    }
+
+    unsigned long recorded =
+        atomic_load_explicit(&r->recorded, memory_order_acquire);
+    unsigned long i = recorded > TRACE_EVENTS ? recorded - TRACE_EVENTS : 0;
+    for (; i < recorded; i++) {
+      const TraceEvent *e = &r->events[i % TRACE_EVENTS];
+      fprintf(out,
+              "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+              "\"ts\": %.3f, \"dur\": %.3f}",
+              first ? "" : ",\n", e->name, r->tid, trace_us(e->start),
+              (e->end - e->start) / 1e3);
+      first = false;
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+  fprintf(out, "\n]}\n");
+  fclose(out);
+}
+
+// Call once from main, before any other thread starts
+void trace_init() {
+  trace_path = getenv("SEAM_TRACE");
+  if (trace_path == NULL || trace_path[0] == '\0') {
+    return;
+  }
+  trace_origin = trace_now();
+  pthread_key_create(&ring_key, trace_ring_release);
+  trace_enabled = true;
+  trace_thread_name("main");
+  atexit(trace_flush);
+}
@@ -0,0 +1,342 @@
+#include "video.h"
+
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "carve.h"
+#include "trace.h"
+
+// Columns searched on each side of last frame's seam
+#define BAND_RADIUS 8
+// Cost of every column a seam drifts from last frame's, in luminance levels
+#define COHERENCE 4.0f
+// Mean luminance difference between two frames above which the second one
+// is carved from scratch
+#define SCENE_CUT 24.0f
+
+typedef struct {
+  int width;
+  int height;
+  // Chroma subsampling, zero for a luma only stream
+  int sx;
+  int sy;
+  // Header tags other than the size, passed through as they are
+  char tags[256];
+} Y4MHeader;
+
+typedef struct {
+  Arena arena;
+  Y4MHeader header;
+  int target_width;
+  int seams;
+
+  // One frame as read and as written
+  uint8_t *in;
+  uint8_t *out;
+  size_t in_bytes;
+  size_t out_bytes;
+
+  // Luma and full resolution chroma being carved, and last frame's luma
+  uint8_t *planes[3];
+  uint8_t *previous;
+
+  Mat luminance;
+  Mat gradient;
+  Mat dp;
+
+  // The seams of the current frame, which guide those of the next one
+  int *seams_at;
+  int *seam;
+  float *band_cost;
+  int8_t *band_trace;
+} Clip;
+
+static int plane_width(int width, int sub) { return (width + sub - 1) / sub; }
+
+static size_t frame_bytes(const Y4MHeader *header, int width) {
+  size_t luma = (size_t)width * header->height;
+  if (header->sx == 0) {
+    return luma;
+  }
+  size_t chroma = (size_t)plane_width(width, header->sx) *
+                  plane_width(header->height, header->sy);
+  return luma + 2 * chroma;
+}
+
+static bool parse_colorspace(const char *tag, Y4MHeader *header) {
+  if (strcmp(tag, "420") == 0 || strcmp(tag, "420jpeg") == 0 ||
+      strcmp(tag, "420paldv") == 0 || strcmp(tag, "420mpeg2") == 0) {
+    header->sx = header->sy = 2;
+  } else if (strcmp(tag, "422") == 0) {
+    header->sx = 2;
+    header->sy = 1;
+  } else if (strcmp(tag, "444") == 0) {
+    header->sx = header->sy = 1;
+  } else if (strcmp(tag, "mono") == 0) {
+    header->sx = header->sy = 0;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool read_header(FILE *in, Y4MHeader *header) {
+  char line[1024];
+  if (fgets(line, sizeof(line), in) == NULL ||
+      strncmp(line, "YUV4MPEG2 ", 10) != 0) {
+    fprintf(stderr, "Input is not a Y4M stream\n");
+    return false;
+  }
+
+  *header = (Y4MHeader){.sx = 2, .sy = 2};
+  size_t used = 0;
+  for (char *tag = strtok(line + 10, " \n"); tag != NULL;
+       tag = strtok(NULL, " \n")) {
+    if (tag[0] == 'W') {
+      header->width = atoi(tag + 1);
+    } else if (tag[0] == 'H') {
+      header->height = atoi(tag + 1);
+    } else {
+      if (tag[0] == 'C' && !parse_colorspace(tag + 1, header)) {
+        fprintf(stderr, "Unsupported Y4M colorspace %s\n", tag + 1);
+        return false;
+      }
+      int n = snprintf(header->tags + used, sizeof(header->tags) - used,
+                       " %s", tag);
+      used += n > 0 ? n : 0;
+      if (used >= sizeof(header->tags)) {
+        fprintf(stderr, "Y4M header too long\n");
+        return false;
+      }
+    }
+  }
+
+  if (header->width <= 0 || header->height <= 0) {
+    fprintf(stderr, "Y4M header has no frame size\n");
+    return false;
+  }
+  return true;
+}
+
+// Reads one frame: 1 if there was one, 0 at the end of the stream and -1 if
+// the stream is broken
+static int read_frame(Clip *c, FILE *in, char *tags, size_t size) {
+  if (fgets(tags, size, in) == NULL) {
+    return ferror(in) ? -1 : 0;
+  }
+  if (strncmp(tags, "FRAME", 5) != 0) {
+    fprintf(stderr, "Corrupt Y4M frame header\n");
+    return -1;
+  }
+  if (fread(c->in, 1, c->in_bytes, in) != c->in_bytes) {
+    fprintf(stderr, "Truncated Y4M frame\n");
+    return -1;
+  }
+  return 1;
+}
+
+// Chroma is carved at full resolution, every sample repeated over the pixels
+// it covers
+static void expand_chroma(Clip *c) {
+  const Y4MHeader *h = &c->header;
+  int w = h->width;
+  int cw = plane_width(w, h->sx);
+  int ch = plane_width(h->height, h->sy);
+  for (int p = 1; p < 3; p++) {
+    const uint8_t *src = c->in + (size_t)w * h->height + (p - 1) * cw * ch;
+    uint8_t *dst = c->planes[p];
+    for (int y = 0; y < h->height; y++) {
+      const uint8_t *src_row = &src[(size_t)(y / h->sy) * cw];
+      for (int x = 0; x < w; x++) {
+        dst[(size_t)y * w + x] = src_row[x / h->sx];
+      }
+    }
+  }
+}
+
+// Averages the carved full resolution chroma back down to its sampling
+static void shrink_chroma(Clip *c) {
+  const Y4MHeader *h = &c->header;
+  int w = c->target_width;
+  int cw = plane_width(w, h->sx);
+  int ch = plane_width(h->height, h->sy);
+  for (int p = 1; p < 3; p++) {
+    const uint8_t *src = c->planes[p];
+    uint8_t *dst = c->out + (size_t)w * h->height + (p - 1) * cw * ch;
+    for (int cy = 0; cy < ch; cy++) {
+      int y1 = (cy + 1) * h->sy < h->height ? (cy + 1) * h->sy : h->height;
+      for (int cx = 0; cx < cw; cx++) {
+        int x1 = (cx + 1) * h->sx < w ? (cx + 1) * h->sx : w;
+        int sum = 0;
+        int n = 0;
+        for (int y = cy * h->sy; y < y1; y++) {
+          for (int x = cx * h->sx; x < x1; x++) {
+            sum += src[(size_t)y * h->width + x];
+            n++;
+          }
+        }
+        dst[(size_t)cy * cw + cx] = (sum + n / 2) / n;
+      }
+    }
+  }
+}
+
+static bool scene_cut(Clip *c) {
+  size_t pixels = (size_t)c->header.width * c->header.height;
+  uint64_t diff = 0;
+  for (size_t i = 0; i < pixels; i++) {
+    diff += abs(c->in[i] - c->previous[i]);
+  }
+  memcpy(c->previous, c->in, pixels);
+  return diff > SCENE_CUT * pixels;
+}
+
+static void remove_seam(Clip *c, const int *seam, int width) {
+  TRACE_SCOPE("remove_seam");
+  int planes = c->header.sx == 0 ? 1 : 3;
+  int stride = c->header.width;
+  for (int y = 0; y < c->header.height; y++) {
+    int x = seam[y];
+    for (int p = 0; p < planes; p++) {
+      uint8_t *row = &c->planes[p][(size_t)y * stride];
+      memmove(row + x, row + x + 1, width - x - 1);
+    }
+    mat_remove_column_at_row(c->gradient, y, x);
+  }
+  c->gradient.width -= 1;
+}
+
+/*
+Removes the seams of one frame. Each seam is searched for in the image left
+by the seams before it, as for a still image, so seam i of one frame guides
+seam i of the next.
+*/
+static void carve_frame(Clip *c, bool full) {
+  TRACE_SCOPE(full ? "frame" : "banded_frame");
+  int w = c->header.width;
+  int h = c->header.height;
+
+  memcpy(c->planes[0], c->in, (size_t)w * h);
+  if (c->header.sx != 0) {
+    expand_chroma(c);
+  }
+  for (int y = 0; y < h; y++) {
+    float *row = MAT_ROW(c->luminance, y);
+    for (int x = 0; x < w; x++) {
+      row[x] = c->in[(size_t)y * w + x];
+    }
+  }
+  c->gradient.width = w;
+  {
+    TRACE_SCOPE("sobel_filter");
+    sobel_filter(c->luminance, c->gradient);
+  }
+
+  for (int i = 0; i < c->seams; i++) {
+    int *seam = &c->seams_at[(size_t)i * h];
+    if (full) {
+      TRACE_SCOPE("full_seam");
+      c->dp.width = c->gradient.width;
+      gradient_to_dp(c->gradient, c->dp);
+      compute_seam(c->dp, seam);
+    } else {
+      TRACE_SCOPE("band_seam");
+      band_seam(c->gradient, seam, BAND_RADIUS, COHERENCE, c->band_cost,
+                c->band_trace, c->seam);
+      memcpy(seam, c->seam, h * sizeof(int));
+    }
+    remove_seam(c, seam, w - i);
+  }
+
+  int tw = c->target_width;
+  for (int y = 0; y < h; y++) {
+    memcpy(&c->out[(size_t)y * tw], &c->planes[0][(size_t)y * w], tw);
+  }
+  if (c->header.sx != 0) {
+    shrink_chroma(c);
+  }
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool video_carve(const VideoOptions *options) {
+  Clip c = {0};
+  if (!read_header(stdin, &c.header)) {
+    return false;
+  }
+
+  int w = c.header.width;
+  int h = c.header.height;
+  // Half the width by default, as in the viewer
+  c.target_width = options->target_width > 0 ? options->target_width : w / 2;
+  if (c.target_width <= 0 || c.target_width > w) {
+    fprintf(stderr, "Target width must be between 1 and %d\n", w);
+    return false;
+  }
+  c.seams = w - c.target_width;
+
+  c.in_bytes = frame_bytes(&c.header, w);
+  c.out_bytes = frame_bytes(&c.header, c.target_width);
+  size_t pixels = (size_t)w * h;
+  int band = 2 * BAND_RADIUS + 1;
+  size_t size = arena_bytes(c.in_bytes, 1) + arena_bytes(c.out_bytes, 1) +
+                4 * arena_bytes(pixels, 1) + 3 * mat_bytes(w, h) +
+                arena_bytes((size_t)(c.seams + 1) * h, sizeof(int)) +
+                arena_bytes((size_t)band * h, sizeof(float)) +
+                arena_bytes((size_t)band * h, sizeof(int8_t));
+
+  c.arena = arena_new(size);
+  c.in = arena_alloc(&c.arena, c.in_bytes, 1);
+  c.out = arena_alloc(&c.arena, c.out_bytes, 1);
+  for (int p = 0; p < 3; p++) {
+    c.planes[p] = arena_alloc(&c.arena, pixels, 1);
+  }
+  c.previous = arena_alloc(&c.arena, pixels, 1);
+  c.luminance = mat_alloc(&c.arena, w, h, 0.0f);
+  c.gradient = mat_alloc(&c.arena, w, h, 0.0f);
+  c.dp = mat_alloc(&c.arena, w, h, FLT_MAX);
+  c.seams_at = arena_alloc(&c.arena, (size_t)c.seams * h, sizeof(int));
+  c.seam = arena_alloc(&c.arena, h, sizeof(int));
+  c.band_cost = arena_alloc(&c.arena, (size_t)band * h, sizeof(float));
+  c.band_trace = arena_alloc(&c.arena, (size_t)band * h, sizeof(int8_t));
+
+  bool ok = fprintf(stdout, "YUV4MPEG2 W%d H%d%s\n", c.target_width, h,
+                    c.header.tags) > 0;
+
+  double start = now();
+  int frames = 0;
+  int full_frames = 0;
+  char tags[256];
+  int more = 1;
+  while (ok && (more = read_frame(&c, stdin, tags, sizeof(tags))) > 0) {
+    bool full = frames == 0 || scene_cut(&c);
+    if (frames == 0) {
+      memcpy(c.previous, c.in, pixels);
+    }
+    carve_frame(&c, full);
+    ok = fputs(tags, stdout) >= 0 &&
+         fwrite(c.out, 1, c.out_bytes, stdout) == c.out_bytes;
+    frames++;
+    full_frames += full;
+  }
+  ok = more == 0 && fflush(stdout) == 0 && ok;
+
+  double elapsed = now() - start;
+  fprintf(stderr,
+          "Carved %d frames from %d to %d columns at %.1f fps, %d of them "
+          "from scratch\n",
+          frames, w, c.target_width, elapsed > 0 ? frames / elapsed : 0.0,
+          full_frames);
+
+  arena_destroy(&c.arena);
+  return ok;
+}
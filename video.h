@@ -0,0 +1,20 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <stdbool.h>
+
+/*
+Carves a Y4M stream from stdin to stdout, frame by frame, down to a target
+width. The first frame, and any frame after a scene cut, is carved like a
+still image. The seams of every other frame are searched for in a narrow
+band around the same seams in the previous frame, with a cost for drifting
+away from them, so that they stay put from one frame to the next instead of
+jittering.
+*/
+typedef struct {
+  int target_width;
+} VideoOptions;
+
+bool video_carve(const VideoOptions *options);
+
+#endif // VIDEO_H